@@ -13,10 +13,554 @@ Test harness for the tsClusters template class
 
 #include <random>
 #include <iostream>
+#include <vector>
+#include <string>
+#include <limits>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
 
 #define TS_DIMENSIONS 5
 #define TS_DATAPOINTS 1000
 
+/*******************
+Fill an integer data set with two blobs of points, spread evenly up to 50
+either side of 0 and of 1000 in every dimension, alternating point by point
+********************/
+static std::vector<int> make_integer_blobs(unsigned int count, unsigned int dimensions)
+{
+	std::vector<int> data(count * dimensions);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		for (unsigned int j = 0; j < dimensions; j++)
+			data[i * dimensions + j] = (i % 2) * 1000 + rand() % 101 - 50;
+	}
+	return data;
+}
+
+/*******************
+Whether each of two integer clusters has landed within a few units of the 
+middle of one of the blobs, one on each
+********************/
+static bool on_blob_middles(const int* clusters, unsigned int dimensions)
+{
+	bool near_blob[2] = { false, false };
+	for (unsigned int c = 0; c < 2; c++)
+	{
+		for (unsigned int blob = 0; blob < 2; blob++)
+		{
+			bool close = true;
+			for (unsigned int j = 0; j < dimensions; j++)
+				close = close && std::abs(clusters[c * dimensions + j] - (int)blob * 1000) <= 5;
+			near_blob[blob] = near_blob[blob] || close;
+		}
+	}
+	return near_blob[0] && near_blob[1];
+}
+
+/*******************
+Train integer clusters by mini-batch k-means, which must still move them
+toward the mean of their points even though the learning rate is a fraction
+********************/
+static bool check_mini_batch_integer()
+{
+	const unsigned int dimensions = 3, count = 2000;
+	std::vector<int> data = make_integer_blobs(count, dimensions);
+
+	tsClusters<int> clusters;
+	clusters.fill_data_array(data.data(), count * dimensions, dimensions);
+	clusters.set_number_of_clusters(2);
+	clusters.set_initialization_method(tsClusters<int>::init_kmeans_plus_plus);
+	clusters.initialize_clusters();
+	clusters.run_mini_batch(100, 50, 0, false);
+
+	return on_blob_middles(clusters.get_clusters(), dimensions);
+}
+
+/*******************
+Stream integer points through sequential k-means in chunks, where each 
+cluster must end up near the mean of the points it took in, not stuck on
+the first of them
+********************/
+static bool check_stream_integer()
+{
+	const unsigned int dimensions = 3, count = 2000, chunk = 250;
+	std::vector<int> data = make_integer_blobs(count, dimensions);
+
+	tsClusters<int> clusters;
+	clusters.set_number_of_clusters(2);
+	for (unsigned int begin = 0; begin < count; begin += chunk)
+		clusters.add_stream_points(&data[begin * dimensions], chunk * dimensions, dimensions);
+
+	return on_blob_middles(clusters.get_clusters(), dimensions);
+}
+
+/*******************
+Compare the SIMD kernels picked for this processor to the scalar ones, over
+every length up to 100 so each tail length is covered. The values are small
+integers, so every sum is exact and all of them must agree to the bit,
+including which of several equally near clusters is picked. The bounded
+kernel must also add up fractions in just the same order as the plain one.
+********************/
+template <typename T> static bool check_kernels()
+{
+	typedef tsDistanceKernels<T> kernels;
+	const unsigned int longest = 100, rows = 4;
+	std::vector<T> a(longest), b(rows * longest), fraction_a(longest), fraction_b(longest);
+	for (unsigned int i = 0; i < a.size(); i++)
+		a[i] = (T)(rand() % 17 - 8);
+	for (unsigned int i = 0; i < b.size(); i++)
+		b[i] = (T)(rand() % 17 - 8);
+	for (unsigned int i = 0; i < longest; i++)
+	{
+		fraction_a[i] = (T)rand() / RAND_MAX;
+		fraction_b[i] = (T)rand() / RAND_MAX;
+	}
+
+	const typename kernels::squared_distance_function distance = kernels::select();
+	const typename kernels::bounded_distance_function bounded = kernels::select_bounded();
+	const typename kernels::dot4_function dot4 = kernels::select_dot4();
+	bool passed = true;
+
+	for (unsigned int n = 0; n <= longest; n++)
+	{
+		const T expected = kernels::scalar(a.data(), b.data(), n);
+		passed = passed && distance(a.data(), b.data(), n) == expected;
+
+		// Bounded, the sum must be the plain kernel's when it runs to the
+		// end, and never more than it when it stops early
+		passed = passed && bounded(a.data(), b.data(), n, std::numeric_limits<T>::max()) == expected;
+		const T stopped = bounded(a.data(), b.data(), n, expected / 2);
+		passed = passed && stopped >= expected / 2 && stopped <= expected;
+		passed = passed && bounded(fraction_a.data(), fraction_b.data(), n, std::numeric_limits<T>::max()) == 
+			distance(fraction_a.data(), fraction_b.data(), n);
+
+		T dots[4] = { 1, 2, 3, 4 }, expected_dots[4] = { 1, 2, 3, 4 };
+		dot4(a.data(), b.data(), longest, n, dots);
+		kernels::dot4_scalar(a.data(), b.data(), longest, n, expected_dots);
+		for (unsigned int r = 0; r < 4; r++)
+			passed = passed && dots[r] == expected_dots[r];
+	}
+
+	// The nearest of k transposed clusters, for each k up to 40, padded out
+	// the way tsClusters pads them
+	const typename kernels::nearest_transposed_function nearest = kernels::select_nearest_transposed();
+	const unsigned int dimensions = 3;
+	for (unsigned int k = 1; nearest && k <= 40; k++)
+	{
+		const unsigned int k_stride = ((k + kernels::nearest_padding - 1) / kernels::nearest_padding) * kernels::nearest_padding;
+		std::vector<T> transposed(dimensions * k_stride, std::numeric_limits<T>::max());
+		unsigned int expected = 0;
+		T expected_dsq = std::numeric_limits<T>::max();
+		for (unsigned int c = 0; c < k; c++)
+		{
+			T cluster[dimensions];
+			for (unsigned int j = 0; j < dimensions; j++)
+			{
+				cluster[j] = b[c * dimensions + j];
+				transposed[j * k_stride + c] = cluster[j];
+			}
+
+			const T dsq = kernels::scalar(a.data(), cluster, dimensions);
+			if (dsq < expected_dsq)
+			{
+				expected_dsq = dsq;
+				expected = c;
+			}
+		}
+
+		T dsq = 0;
+		passed = passed && nearest(a.data(), transposed.data(), k, k_stride, dimensions, dsq) == expected && dsq == expected_dsq;
+	}
+
+	return passed;
+}
+
+/*******************
+Fill a data set with eight blobs of points that overlap, so training takes a
+good number of rounds
+********************/
+template <typename T> static std::vector<T> make_blobs(unsigned int count, unsigned int dimensions)
+{
+	const unsigned int blobs = 8;
+	std::vector<T> centers(blobs * dimensions), data(count * dimensions);
+	for (unsigned int i = 0; i < centers.size(); i++)
+		centers[i] = (T)(rand() % 100);
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		for (unsigned int j = 0; j < dimensions; j++)
+			data[i * dimensions + j] = centers[(i % blobs) * dimensions + j] + (T)(rand() % 6000) / 100;
+	}
+	return data;
+}
+
+/*******************
+Copy out the clusters without the padding at the end of each row
+********************/
+template <typename C, typename T> static std::vector<T> packed_clusters(C& clusters, unsigned int k, unsigned int dimensions)
+{
+	const T* result = clusters.get_clusters();
+	std::vector<T> packed(k * dimensions);
+	for (unsigned int c = 0; c < k; c++)
+	{
+		for (unsigned int j = 0; j < dimensions; j++)
+			packed[c * dimensions + j] = result[c * clusters.get_row_stride() + j];
+	}
+	return packed;
+}
+
+/*******************
+Pick the starting clusters for a data set by the given method on the given
+number of threads, from a fixed seed
+********************/
+template <typename T> static std::vector<T> seed_with(std::vector<T> data, unsigned int dimensions, unsigned int k, 
+	unsigned int threads, typename tsClusters<T>::initialization_method method)
+{
+	tsClusters<T> clusters;
+	clusters.set_number_of_threads(threads);
+	clusters.set_initialization_method(method);
+	clusters.fill_data_array(data.data(), (unsigned int)data.size(), dimensions);
+	clusters.set_number_of_clusters(k);
+	srand(7);
+	clusters.set_random_seed(7);
+	clusters.initialize_clusters();
+	return packed_clusters<tsClusters<T>, T>(clusters, k, dimensions);
+}
+
+/*******************
+Stream points into clusters over a data set loaded as a view with padded rows,
+then train on the data set, which must go just as it does over a copy of the
+data without the padding
+********************/
+static bool check_stream_over_view()
+{
+	const unsigned int dimensions = 5, padded = 8, count = 1000, k = 4;
+	const std::vector<float> data = make_blobs<float>(count, dimensions);
+	std::vector<float> rows(count * padded, -1.f);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		for (unsigned int j = 0; j < dimensions; j++)
+			rows[i * padded + j] = data[i * dimensions + j];
+	}
+
+	tsClusters<float> view, copy;
+	std::vector<float> copied(data);
+	view.fill_data_view(rows.data(), count * padded, dimensions, padded);
+	copy.fill_data_array(copied.data(), count * dimensions, dimensions);
+
+	tsClusters<float>* both[] = { &view, &copy };
+	for (unsigned int b = 0; b < 2; b++)
+	{
+		both[b]->set_number_of_clusters(k);
+		both[b]->add_stream_points(data.data(), 100 * dimensions, dimensions);
+		for (unsigned int round = 0; round < 10; round++)
+		{
+			both[b]->assign_clusters();
+			both[b]->compute_centroids();
+		}
+	}
+
+	return view.get_row_stride() == padded &&
+		packed_clusters<tsClusters<float>, float>(view, k, dimensions) == packed_clusters<tsClusters<float>, float>(copy, k, dimensions);
+}
+
+/*******************
+Run rounds before the clusters are initialized, and after changing their 
+number without initializing them again, which must leave them alone rather
+than read past them. Lowering the number still trains the ones left.
+********************/
+static bool check_uninitialized_clusters()
+{
+	const unsigned int dimensions = 3, count = 500, k = 4;
+	std::vector<float> data = make_blobs<float>(count, dimensions);
+
+	tsClusters<float> clusters;
+	clusters.fill_data_array(data.data(), count * dimensions, dimensions);
+	clusters.set_number_of_clusters(k);
+	clusters.assign_clusters();
+	clusters.compute_centroids();
+
+	clusters.initialize_clusters();
+	clusters.assign_clusters();
+	clusters.compute_centroids();
+	const std::vector<float> trained = packed_clusters<tsClusters<float>, float>(clusters, k, dimensions);
+
+	clusters.set_number_of_clusters(k * 2);
+	clusters.assign_clusters();
+	clusters.compute_centroids();
+	bool passed = packed_clusters<tsClusters<float>, float>(clusters, k, dimensions) == trained;
+
+	clusters.set_number_of_clusters(k - 1);
+	clusters.compute_centroids();
+	clusters.assign_clusters();
+	clusters.compute_centroids();
+	passed = passed && clusters.get_num_data_points_moved() > 0;
+	return passed;
+}
+
+/*******************
+Start the clusters from a fixed seed, then run rounds until no point moves,
+up to 200, returning how many it took
+********************/
+template <typename C> static unsigned int train(C& clusters, unsigned int k)
+{
+	clusters.set_number_of_clusters(k);
+	srand(7);
+	clusters.set_random_seed(7);
+	clusters.initialize_clusters();
+
+	unsigned int rounds = 0;
+	do
+	{
+		clusters.assign_clusters();
+		clusters.compute_centroids();
+		rounds++;
+	} while (clusters.get_num_data_points_moved() && rounds < 200);
+	return rounds;
+}
+
+/*******************
+Cluster a data set to convergence with the given settings, returning the
+clusters and setting rounds to the number of rounds it took
+********************/
+template <typename T> static std::vector<T> cluster_with(std::vector<T> data, unsigned int dimensions, unsigned int k, 
+	unsigned int threads, void (*configure)(tsClusters<T>&), unsigned int& rounds)
+{
+	tsClusters<T> clusters;
+	clusters.set_number_of_threads(threads);
+	if (configure)
+		configure(clusters);
+	clusters.fill_data_array(data.data(), (unsigned int)data.size(), dimensions);
+	rounds = train(clusters, k);
+	return packed_clusters<tsClusters<T>, T>(clusters, k, dimensions);
+}
+
+template <typename T> static void use_elkan(tsClusters<T>& c) { c.set_assignment_method(tsClusters<T>::assign_elkan); }
+template <typename T> static void use_hamerly(tsClusters<T>& c) { c.set_assignment_method(tsClusters<T>::assign_hamerly); }
+template <typename T> static void use_yinyang(tsClusters<T>& c) { c.set_assignment_method(tsClusters<T>::assign_yinyang); }
+template <typename T> static void use_kd_tree(tsClusters<T>& c) { c.set_assignment_method(tsClusters<T>::assign_kd_tree); }
+template <typename T> static void use_gemm(tsClusters<T>& c) { c.set_assignment_method(tsClusters<T>::assign_gemm); }
+template <typename T> static void use_partial(tsClusters<T>& c) { c.set_partial_distances(true); }
+template <typename T> static void use_partial_ordered(tsClusters<T>& c) { c.set_partial_distances(true, true); }
+template <typename T> static void use_transposed(tsClusters<T>& c) { c.set_transposed_clusters(true); }
+
+/*******************
+Sum the squared distance from each point to its nearest cluster
+********************/
+template <typename T> static double clustering_cost(const std::vector<T>& data, const std::vector<T>& clusters, unsigned int dimensions)
+{
+	double cost = 0;
+	for (size_t i = 0; i < data.size(); i += dimensions)
+	{
+		double nearest = std::numeric_limits<double>::max();
+		for (size_t c = 0; c < clusters.size(); c += dimensions)
+		{
+			double distance = 0;
+			for (unsigned int j = 0; j < dimensions; j++)
+				distance += ((double)data[i + j] - clusters[c + j]) * ((double)data[i + j] - clusters[c + j]);
+			nearest = std::min(nearest, distance);
+		}
+		cost += nearest;
+	}
+	return cost;
+}
+
+/*******************
+Cluster the same data with every assignment method, and check each ends up
+where brute force on one thread does. The methods that find the same
+clusters from the same distances must match it to the bit, on any number of
+threads. The k-d tree sums whole cells at once, and the transposed clusters
+use their own distance kernel, so those two only have to come close. Ordering
+the partial distances by variance sums the dimensions in another order, so a
+near tie can go the other way and take a round more or less; that only has to
+reach the same cost.
+********************/
+template <typename T> static bool check_assignment_methods()
+{
+	// Wide enough rows for the partial distance search to stop early
+	const unsigned int dimensions = 40, count = 3000, k = 12;
+	const std::vector<T> data = make_blobs<T>(count, dimensions);
+
+	unsigned int expected_rounds = 0, rounds = 0;
+	const std::vector<T> expected = cluster_with<T>(data, dimensions, k, 1, nullptr, expected_rounds);
+
+	const double expected_cost = clustering_cost(data, expected, dimensions);
+
+	enum match { match_exact, match_close, match_cost };
+	struct { void (*configure)(tsClusters<T>&); unsigned int threads; match required; } runs[] =
+	{
+		{ nullptr, 4, match_exact },
+		{ &use_elkan<T>, 1, match_exact },
+		{ &use_elkan<T>, 4, match_exact },
+		{ &use_hamerly<T>, 3, match_exact },
+		{ &use_yinyang<T>, 4, match_exact },
+		{ &use_gemm<T>, 1, match_exact },
+		{ &use_gemm<T>, 4, match_exact },
+		{ &use_partial<T>, 4, match_exact },
+		{ &use_partial_ordered<T>, 2, match_cost },
+		{ &use_kd_tree<T>, 4, match_close },
+		{ &use_transposed<T>, 4, match_close },
+	};
+
+	bool passed = true;
+	for (unsigned int r = 0; r < sizeof(runs) / sizeof(runs[0]); r++)
+	{
+		const std::vector<T> result = cluster_with<T>(data, dimensions, k, runs[r].threads, runs[r].configure, rounds);
+		if (runs[r].required == match_cost)
+		{
+			passed = passed && std::abs(clustering_cost(data, result, dimensions) - expected_cost) <= 1e-4 * expected_cost;
+			continue;
+		}
+
+		passed = passed && rounds == expected_rounds;
+		for (unsigned int v = 0; v < result.size(); v++)
+		{
+			if (runs[r].required == match_exact)
+				passed = passed && result[v] == expected[v];
+			else
+				passed = passed && std::abs(result[v] - expected[v]) <= (T)1e-3;
+		}
+	}
+
+	return passed;
+}
+
+/*******************
+Seed by k-means|| on different numbers of threads, over enough points that
+they are sampled in several blocks, which must pick the same clusters
+********************/
+static bool check_kmeans_parallel_threads()
+{
+	const unsigned int dimensions = 4, count = 20000, k = 10;
+	const std::vector<float> data = make_blobs<float>(count, dimensions);
+	const std::vector<float> expected = seed_with<float>(data, dimensions, k, 1, tsClusters<float>::init_kmeans_parallel);
+
+	bool passed = true;
+	const unsigned int threads[] = { 2, 3, 8 };
+	for (unsigned int t = 0; t < sizeof(threads) / sizeof(threads[0]); t++)
+		passed = passed && seed_with<float>(data, dimensions, k, threads[t], tsClusters<float>::init_kmeans_parallel) == expected;
+	return passed;
+}
+
+/*******************
+Train over a data set loaded as a view with padded rows, which must go just
+as it does over a copy of the data without the padding
+********************/
+static bool check_data_view()
+{
+	const unsigned int dimensions = 5, padded = 8, count = 2000, k = 6;
+	std::vector<float> data = make_blobs<float>(count, dimensions);
+	std::vector<float> rows(count * padded, -1.f);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		for (unsigned int j = 0; j < dimensions; j++)
+			rows[i * padded + j] = data[i * dimensions + j];
+	}
+
+	tsClusters<float> view, copy;
+	view.fill_data_view(rows.data(), count * padded, dimensions, padded);
+	copy.fill_data_array(data.data(), count * dimensions, dimensions);
+	const unsigned int view_rounds = train(view, k), copy_rounds = train(copy, k);
+
+	return view_rounds == copy_rounds &&
+		packed_clusters<tsClusters<float>, float>(view, k, dimensions) == packed_clusters<tsClusters<float>, float>(copy, k, dimensions);
+}
+
+/*******************
+Train with the number of dimensions fixed at compile time, which must come
+out as it does with them set at run time, give or take the compiler
+contracting the unrolled sums differently
+********************/
+static bool check_fixed_dimensions()
+{
+	const unsigned int dimensions = 5, count = 2000, k = 6;
+	std::vector<float> data = make_blobs<float>(count, dimensions);
+
+	tsClusters<float, dimensions> fixed;
+	tsClusters<float> dynamic;
+	fixed.fill_data_array(data.data(), count * dimensions, dimensions);
+	dynamic.fill_data_array(data.data(), count * dimensions, dimensions);
+	const unsigned int fixed_rounds = train(fixed, k), dynamic_rounds = train(dynamic, k);
+
+	const std::vector<float> a = packed_clusters<tsClusters<float, dimensions>, float>(fixed, k, dimensions);
+	const std::vector<float> b = packed_clusters<tsClusters<float>, float>(dynamic, k, dimensions);
+	bool passed = fixed_rounds == dynamic_rounds;
+	for (unsigned int v = 0; v < a.size(); v++)
+		passed = passed && std::abs(a[v] - b[v]) <= 1e-3f;
+	return passed;
+}
+
+/*******************
+Train with incremental centroids, with and without summing them in full now
+and then, which must come out within rounding of summing them in full every
+round
+********************/
+template <typename T> static void use_incremental(tsClusters<T>& c) { c.set_incremental_centroids(true); }
+template <typename T> static void use_incremental_exact(tsClusters<T>& c) { c.set_incremental_centroids(true, 4); }
+
+static bool check_incremental_centroids()
+{
+	const unsigned int dimensions = 6, count = 4000, k = 10;
+	const std::vector<float> data = make_blobs<float>(count, dimensions);
+
+	unsigned int rounds = 0;
+	const std::vector<float> expected = cluster_with<float>(data, dimensions, k, 4, nullptr, rounds);
+	void (*configure[])(tsClusters<float>&) = { &use_incremental<float>, &use_incremental_exact<float> };
+
+	bool passed = true;
+	for (unsigned int c = 0; c < 2; c++)
+	{
+		const std::vector<float> result = cluster_with<float>(data, dimensions, k, 4, configure[c], rounds);
+		for (unsigned int v = 0; v < result.size(); v++)
+			passed = passed && std::abs(result[v] - expected[v]) <= 1e-2f;
+	}
+	return passed;
+}
+
+/*******************
+Seed twice by each initialization method from the same seed, which must pick
+the same clusters each time
+********************/
+static bool check_seeding_repeats()
+{
+	const unsigned int dimensions = 4, count = 5000, k = 10;
+	const std::vector<float> data = make_blobs<float>(count, dimensions);
+	const tsClusters<float>::initialization_method methods[] =
+	{
+		tsClusters<float>::init_random_bounds,
+		tsClusters<float>::init_kmeans_plus_plus,
+		tsClusters<float>::init_kmeans_parallel,
+		tsClusters<float>::init_mcmc,
+	};
+
+	bool passed = true;
+	for (unsigned int m = 0; m < sizeof(methods) / sizeof(methods[0]); m++)
+		passed = passed && seed_with<float>(data, dimensions, k, 4, methods[m]) == seed_with<float>(data, dimensions, k, 4, methods[m]);
+	return passed;
+}
+
+/*******************
+Parse some processor lists as Linux writes them, and some garbled ones
+********************/
+static bool check_parse_processor_list()
+{
+	const struct { const char* list; std::vector<unsigned int> numbers; } cases[] =
+	{
+		{ "", {} },
+		{ "5", { 5 } },
+		{ "0-3,8", { 0, 1, 2, 3, 8 } },
+		{ "0-1,4-5,7", { 0, 1, 4, 5, 7 } },
+		{ "3-1,x,7", { 3, 7 } },
+		{ "2,,9-", { 2, 9 } },
+	};
+
+	bool passed = true;
+	for (unsigned int c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+		passed = passed && tsThreadPool::parse_processor_list(cases[c].list) == cases[c].numbers;
+	return passed;
+}
+
 /*******************
 Main application entry point
 ********************/
@@ -63,8 +607,54 @@ int main(int argc, char* argv[])
 	std::cout << "Convergence complete in " << round_counter << " rounds!" << std::endl;
 	std::cout << "Least sum of squares found for the data set given." << std::endl;
 	std::cout << std::endl;
+
+	bool passed = true;
+	const bool mini_batch_integer = check_mini_batch_integer();
+	std::cout << "Mini-batch with integer clusters: " << (mini_batch_integer ? "passed" : "FAILED") << std::endl;
+	passed = passed && mini_batch_integer;
+	const bool stream_integer = check_stream_integer();
+	std::cout << "Streaming with integer clusters: " << (stream_integer ? "passed" : "FAILED") << std::endl;
+	passed = passed && stream_integer;
+	const bool stream_view = check_stream_over_view();
+	std::cout << "Streaming over a data view: " << (stream_view ? "passed" : "FAILED") << std::endl;
+	passed = passed && stream_view;
+	const bool uninitialized = check_uninitialized_clusters();
+	std::cout << "Rounds without initialized clusters: " << (uninitialized ? "passed" : "FAILED") << std::endl;
+	passed = passed && uninitialized;
+	const bool float_kernels = check_kernels<float>();
+	std::cout << "Distance kernels for float (" << tsDistanceKernels<float>::selected_name() << "): " << (float_kernels ? "passed" : "FAILED") << std::endl;
+	passed = passed && float_kernels;
+	const bool double_kernels = check_kernels<double>();
+	std::cout << "Distance kernels for double (" << tsDistanceKernels<double>::selected_name() << "): " << (double_kernels ? "passed" : "FAILED") << std::endl;
+	passed = passed && double_kernels;
+	const bool float_methods = check_assignment_methods<float>();
+	std::cout << "Assignment methods for float: " << (float_methods ? "passed" : "FAILED") << std::endl;
+	passed = passed && float_methods;
+	const bool double_methods = check_assignment_methods<double>();
+	std::cout << "Assignment methods for double: " << (double_methods ? "passed" : "FAILED") << std::endl;
+	passed = passed && double_methods;
+	const bool data_view = check_data_view();
+	std::cout << "Data view against a copied array: " << (data_view ? "passed" : "FAILED") << std::endl;
+	passed = passed && data_view;
+	const bool fixed_dimensions = check_fixed_dimensions();
+	std::cout << "Dimensions fixed at compile time: " << (fixed_dimensions ? "passed" : "FAILED") << std::endl;
+	passed = passed && fixed_dimensions;
+	const bool incremental = check_incremental_centroids();
+	std::cout << "Incremental centroids: " << (incremental ? "passed" : "FAILED") << std::endl;
+	passed = passed && incremental;
+	const bool seeding = check_seeding_repeats();
+	std::cout << "Seeding from a fixed seed: " << (seeding ? "passed" : "FAILED") << std::endl;
+	passed = passed && seeding;
+	const bool kmeans_parallel = check_kmeans_parallel_threads();
+	std::cout << "k-means|| seeding on any number of threads: " << (kmeans_parallel ? "passed" : "FAILED") << std::endl;
+	passed = passed && kmeans_parallel;
+	const bool processor_list = check_parse_processor_list();
+	std::cout << "Processor list parsing: " << (processor_list ? "passed" : "FAILED") << std::endl;
+	passed = passed && processor_list;
+	std::cout << std::endl;
+
 	std::cout << "Press Enter to Exit." << std::endl;
 	std::cin.get();
 
-	return 0;
+	return passed ? 0 : 1;
 }
\ No newline at end of file
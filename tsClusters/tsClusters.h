@@ -16,19 +16,27 @@
 #include <vector>
 #include <memory>
 #include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <type_traits>
+#include <random>
+
+#include "tsThreadPool.h"
+#include "tsDistanceKernels.h"
 
 /*******************
 The idea here is to have a template class for N-dimensional arrays that
 can be searched for M clusters.
 
 Internally, each data point is comprised of some number of T values. 
-Those T values are stored in a vector, which is inside a struct that pairs
-the vector of T's with a cluster index to which the data point is currently
-assigned.
-
-Then all of these structs of vectors of T's are placed in a vector that 
-is the entire dataset. Thus you can traverse the full data set, find a 
-data point and look at its T values and cluster assigned. 
+All of the data points are stored back to back in one contiguous, row-major
+block of T values, so point i starts at data[i * row_stride]. Rows may be 
+padded out with zeros so that each row starts on a nicely aligned boundary.
+
+The cluster index each data point is currently assigned to, and its squared
+distance to that cluster, are kept in separate arrays parallel to the data.
+Thus you can traverse the full data set linearly, find a data point by index
+and look at its T values and cluster assigned. 
 ********************/
 
 /*******************
@@ -43,52 +51,316 @@ TODO List:
 	-Add cluster assignment [ DONE ]
 	-Add centroid computation [ DONE ]
 	-Add checks for movement, whether a data point changed clusters
-	-Add multi-threading and experiment with workload distribution 
+	-Add multi-threading and experiment with workload distribution [ DONE ]
+********************/
+
+/*******************
+An allocator that leaves new elements of a vector uninitialized when they
+are made without a value (as by resize), rather than zeroing them. The memory
+is then first written, and so placed on a NUMA node by the operating system,
+by whichever thread fills it in, rather than by the thread that sized it.
 ********************/
+template <typename T> class tsFirstTouchAllocator : public std::allocator<T>
+{
+public:
+	template <typename U> struct rebind { typedef tsFirstTouchAllocator<U> other; };
+
+	tsFirstTouchAllocator() {}
+	template <typename U> tsFirstTouchAllocator(const tsFirstTouchAllocator<U>&) {}
+
+	template <typename U> void construct(U* p) { ::new((void*)p) U; }
+	template <typename U, typename... Args> void construct(U* p, Args&&... args) { ::new((void*)p) U(std::forward<Args>(args)...); }
+};
 
 /*******************
 A template class for cluster analysis across an N-dimensional array
+
+N is an optional compile-time number of dimensions. When it is left as 0 the
+dimension is taken at runtime from the stride given to fill_data_array, and
+when it is set the stride must match it, which lets the compiler fully unroll
+the per-dimension loops (e.g. tsClusters<float, 3> for RGB or XYZ data).
 ********************/
-template <typename T> class tsClusters
+template <typename T, unsigned int N = 0> class tsClusters
 {
 public:
+	/* The algorithms assign_clusters can use to find the closest cluster */
+	enum assignment_method
+	{
+		assign_brute_force, // Compare every data point to every cluster
+		assign_elkan, // Skip comparisons using Elkan's triangle inequality bounds
+		assign_hamerly, // Skip whole points using Hamerly's single lower bound
+		assign_yinyang, // Skip groups of clusters using Yinyang's group bounds
+		assign_kd_tree, // Assign whole cells of a k-d tree over the data at once, on one thread
+		assign_gemm, // Expand the distances into norms and blocked dot products, for high dimensions
+	};
+
+	/* The ways initialize_clusters can pick the starting clusters */
+	enum initialization_method
+	{
+		init_random_bounds, // Uniformly at random in the bounding box of the data
+		init_kmeans_plus_plus, // Data points picked by k-means++ D^2 sampling
+		init_kmeans_parallel, // Data points picked by k-means|| oversampling rounds
+		init_mcmc, // Data points picked by AFK-MC^2 Markov chains approximating k-means++
+	};
+
 	tsClusters();
 	tsClusters(const tsClusters&); // Copy constructor
 	virtual ~tsClusters(); // Destructor
 	tsClusters& operator=(const tsClusters&); // Assignment operator
 	// TODO: What about a move operator?
 	unsigned int fill_data_array(T* input, unsigned int size,  unsigned int stride);
+	// Cluster directly over a caller-owned buffer without copying it
+	unsigned int fill_data_view(const T* input, unsigned int size, unsigned int stride, unsigned int row_stride = 0);
+	// Pad each data row to a multiple of this many T values (call before filling)
+	void set_row_alignment(unsigned int alignment);
 	void set_number_of_clusters(unsigned int num_clusters);
+	// Choose how initialize_clusters picks the starting clusters
+	void set_initialization_method(initialization_method method){ initialization = method; };
+	// Set the Markov chain length used per cluster by init_mcmc (200 by default)
+	void set_mcmc_chain_length(unsigned int length){ if (length) mcmc_chain_length = length; };
 	void initialize_clusters();
 	void assign_clusters(); // For each data point, assign the closest cluster to it
 	// For each cluster, recompute the position 
 	// as the centroid of all associated data points
 	void compute_centroids(); 
+	// Keep the cluster sums from round to round, updated only for the points
+	// that moved, summing them in full again every exact_every rounds (0 never)
+	void set_incremental_centroids(bool enable, unsigned int exact_every = 0);
 	// Return the number of data points that moved in the last round
 	unsigned int get_num_data_points_moved(){ return data_points_moved; };
+	// Train on random mini-batches of the data until the clusters stop moving
+	unsigned int run_mini_batch(unsigned int batch_size, unsigned int max_iterations, T tolerance, bool assign_all = true);
+	// Update the clusters online from a chunk of streamed points
+	unsigned int add_stream_points(const T* input, unsigned int size, unsigned int stride);
+	// Seed the random number generator used for sampling the data
+	void set_random_seed(unsigned int seed){ random_engine.seed(seed); };
+	// Set the number of worker threads (0, the default, for get_cpu_count)
+	void set_number_of_threads(unsigned int threads);
+	// Return the number of processors we can use, as found by tsThreadPool::cpu_budget
+	unsigned int get_cpu_count(){ return cpu_count; };
+	// Override the number of processors we can use (0 to detect it again)
+	void set_cpu_count(unsigned int count);
+	// Run on a thread pool shared with other objects, instead of one of our own
+	void set_thread_pool(std::shared_ptr<tsThreadPool> shared_pool);
+	// Place the data and worker threads per NUMA node (off by default)
+	void set_numa_aware(bool enable);
+	// Choose the algorithm assign_clusters uses (brute force by default)
+	void set_assignment_method(assignment_method method);
+	// Keep a transposed (dimension-major) copy of the clusters for assignment
+	void set_transposed_clusters(bool enable);
+	// Use the SIMD distance kernels, where the processor has them (on by default)
+	void set_simd_distances(bool enable);
+	// Give up on each distance in a brute force search once it can't be the
+	// nearest, optionally summing the dimensions in order of their variance
+	void set_partial_distances(bool enable, bool order_by_variance = false);
+	// Return a pointer to the k x row_stride cluster matrix
+	const T* get_clusters(){ return clusters->data(); };
+	// Return the distance in T values from one cluster to the next
+	unsigned int get_row_stride(){ return row_stride; };
 private:
-	/* This is the internal data structure for storing each data point
-	of N dimensions, where each data point has a cluster index to which
-	it is assigned.	*/
-	struct data_structure
-	{
-		std::vector<T> p; // The N-dimensional point
-		unsigned int ci; // The cluster index
-		T distance_squared; // Distance to the nearest cluster
+	/* A vector whose new elements are left to be placed in memory by the 
+	thread that first fills them in */
+	template <typename V> using placed_vector = std::vector<V, tsFirstTouchAllocator<V>>;
+
+	/* A shared pointer to the data vector itself, of which there may be
+	any number of points. Each point is row_stride T values wide, of which
+	the first stride values are the N-dimensional point and the rest are
+	zero padding. */
+	std::shared_ptr<placed_vector<T>> data;
+
+	/* Pointer to the first data point. This points into data when the
+	data was copied in by fill_data_array, or at the caller's own buffer
+	when set up as a view by fill_data_view, in which case data is empty. */
+	const T* points;
+
+	/* The cluster index assigned to each data point, parallel to data */
+	std::shared_ptr<placed_vector<unsigned int>> assignments;
+
+	/* The squared distance from each data point to its nearest cluster,
+	parallel to data */
+	std::shared_ptr<placed_vector<T>> distances;
+
+	/* Number of data points (rows) in the data vector */
+	unsigned int number_of_points;
+
+	/* The clusters are referenced by index and stored the same way as
+	the data, as one contiguous number_of_clusters x row_stride matrix, thus
+	cluster(0) is the first index, cluster(1) is the second, and so on */
+	std::shared_ptr<std::vector<T>> clusters;
+
+	/* Optional transposed copy of the clusters, a stride x transposed_stride
+	matrix, so that dimension j of every cluster is contiguous. This lets the
+	assignment step scan all the clusters for one data point in a single
+	linear sweep. Each row is padded out past number_of_clusters to a whole
+	number of SIMD vectors with infinity, which is never the nearest. */
+	std::vector<T> clusters_transposed;
+	unsigned int transposed_stride;
+	bool use_transposed_clusters;
+
+	/* Per-cluster running sums of the assigned data points and the count of
+	points assigned to each cluster. These are accumulated by assign_clusters
+	as it assigns each point, so that compute_centroids doesn't need another
+	pass over the data, and are only valid until the next compute_centroids.
+	There is a block of sums and counts for each slice of sum_block_points
+	data points, summed in point order, with the slices' blocks added up
+	into block 0. The number of slices is up to sum_slices, as set by
+	sum_slice_count from the size of the data and the clusters alone, never
+	the number of threads, so the sums come out the same on any machine. 
+	Each block has
+	number_of_clusters rows of sum_row_stride T values and count_block_stride
+	counts, rounded up to whole cache lines so no two threads ever write to
+	the same line. */
+	static const unsigned int sum_slices = 32;
+	static const unsigned int sum_slice_min_points = 1024;
+	static const size_t sum_slice_memory = (size_t)64 << 20;
+	std::vector<T> cluster_sums;
+	std::vector<unsigned int> cluster_counts;
+	unsigned int sum_blocks;
+	unsigned int sum_block_points;
+	unsigned int sum_row_stride;
+	unsigned int count_block_stride;
+	bool cluster_sums_valid;
+
+	/* For incremental centroids, block 0 of the cluster sums is kept from
+	round to round while incremental_sums_valid, as the sums for the current
+	assignments, and assign_clusters only moves the points that changed
+	cluster from one sum to the other. While tracking_moves, assign_in_parallel
+	lists those points in moved_points, in order, with the cluster each one
+	had before. The sums are redone in full every exact_recompute_interval
+	rounds, if set, so rounding can't build up in them. */
+	bool incremental_centroids;
+	bool incremental_sums_valid;
+	bool tracking_moves;
+	bool moves_listed;
+	unsigned int exact_recompute_interval;
+	unsigned int rounds_since_exact;
+	std::vector<std::pair<unsigned int, unsigned int>> moved_points;
+
+	/* Whether each cluster has gained or lost any points since the last
+	compute_centroids, which need not recompute the others. This only holds
+	while centroids_current, which is when every cluster is the mean of its
+	points as of that compute_centroids; anything else that moves the
+	clusters clears it. */
+	std::vector<unsigned char> cluster_changed;
+	bool centroids_current;
+
+	/* How many data points have been folded into each cluster by the 
+	online updates of mini-batch training, which sets each cluster's 
+	learning rate. Reset whenever the clusters are initialized. */
+	std::vector<unsigned long long> cluster_update_counts;
+
+	/* When the clusters were created by streaming rather than by 
+	initialize_clusters, the number of them still waiting to be placed on
+	the first streamed points */
+	unsigned int stream_clusters_unplaced;
+
+	/* Random number generator for sampling the data */
+	std::mt19937 random_engine;
+
+	/* Whether assign_clusters adds each point into the cluster sums as it
+	goes, which it can only do when a single thread does the assigning, or
+	for the k-d tree, which adds whole nodes into a single block */
+	bool fuse_cluster_sums;
+
+	/* Distances between points and clusters that are used as bounds by the
+	accelerated assignment methods are kept as actual (not squared) 
+	distances, in T when it is a floating point type or double otherwise */
+	typedef typename std::conditional<std::is_floating_point<T>::value, T, double>::type bound_type;
+
+	assignment_method method;
+	initialization_method initialization;
+	unsigned int mcmc_chain_length;
+
+	/* Whether the per-point bounds of the current assignment method still
+	hold for the current clusters, give or take the shifts below. Anything
+	that moves the clusters other than compute_centroids clears this. */
+	bool bounds_valid;
+
+	/* How far each cluster has moved since the bounds were last updated,
+	accumulated by compute_centroids, and which clusters have moved at all,
+	so bounds on the others can be left alone */
+	std::vector<bound_type> cluster_shift;
+	std::vector<unsigned int> moved_clusters;
+
+	/* Half the distance between every pair of clusters, a number_of_clusters 
+	squared matrix, and for each cluster half the distance to its nearest
+	other cluster. Any point closer to its cluster than that can't be 
+	closer to another one. */
+	std::vector<bound_type> cluster_half_distances;
+	std::vector<bound_type> cluster_half_nearest;
+
+	/* Lower bounds on the distance from each data point to the clusters
+	it isn't assigned to. For Elkan this is a number_of_points x 
+	number_of_clusters matrix with a bound for every cluster, for Hamerly
+	one bound per point on the distance to the second closest cluster, and
+	for Yinyang a number_of_points x number_of_groups matrix with a bound 
+	for each group of clusters.
+	The matching upper bound on the distance to the assigned cluster is kept
+	squared in distances. */
+	placed_vector<bound_type> lower_bounds;
+
+	/* The largest and second largest of the cluster shifts, and the index of
+	the cluster with the largest, for loosening Hamerly's lower bounds */
+	bound_type max_shift;
+	bound_type second_max_shift;
+	unsigned int max_shift_index;
+
+	/* Yinyang's groups of clusters, formed once when its bounds are set up.
+	The clusters in group g are group_clusters[group_begin[g]] up to 
+	group_clusters[group_begin[g + 1]], in index order. group_shift is the 
+	most any cluster in each group has moved. */
+	unsigned int number_of_groups;
+	std::vector<unsigned int> cluster_group;
+	std::vector<unsigned int> group_begin;
+	std::vector<unsigned int> group_clusters;
+	std::vector<bound_type> group_shift;
+
+	/* A k-d tree over the data points for the filtering method, built once
+	per data set. Each node covers the points tree_order[begin] up to
+	tree_order[end], and is either a leaf (left == 0) or split in two at the
+	median of its widest dimension. For each node, tree_bounds holds the 
+	lower then the upper corner of the box around its points (2 x stride 
+	values) and tree_sums holds the sum of its points (stride values), so a 
+	whole node can be added into a cluster at once. */
+	struct kd_node
+	{
+		unsigned int begin;
+		unsigned int end;
+		unsigned int left;
+		unsigned int right;
 	};
-
-	/* A shared pointer to the data vector itself, of which there
-	may be any number of points, each with its own assigned cluster */
-	std::shared_ptr<std::vector<data_structure>> data;
-
-	/* The clusters are referenced by index, so we just need a shared
-	pointer to the vector of vectors (2 dimensional layout), thus
-	clusters[0] is the first index, clusters[1] is the second, and so on */
-	std::shared_ptr<std::vector<std::vector<T>>> clusters;
+	std::vector<kd_node> tree_nodes;
+	std::vector<unsigned int> tree_order;
+	std::vector<T> tree_bounds;
+	std::vector<T> tree_sums;
+	bool tree_valid;
+
+	/* Stack of candidate cluster lists while filtering down the tree */
+	std::vector<unsigned int> tree_candidates;
+
+	/* For the matrix product method, the squared norm of every data point,
+	computed once per data set, and of every cluster, computed every round */
+	placed_vector<T> point_norms;
+	bool point_norms_valid;
+	std::vector<T> cluster_norms;
+
+	/* The SIMD kernel for four dot products at once, picked for the processor,
+	and the size of the tiles the matrix product is blocked into: this many
+	points by this many clusters, this many dimensions at a time, so each
+	tile of points and of clusters stays in cache while the other goes by */
+	typename tsDistanceKernels<T>::dot4_function dot4_kernel;
+	static const unsigned int gemm_point_tile = 32;
+	static const unsigned int gemm_cluster_tile = 32;
+	static const unsigned int gemm_dimension_tile = 256;
 	
 	/* Stride is number of number of dimensions to the data */
 	unsigned int stride;
 
+	/* Row stride is the distance in T values from one data point to the
+	next, which is the stride rounded up to a multiple of row_alignment */
+	unsigned int row_stride;
+	unsigned int row_alignment;
+
 	/* This is not redundant, because changing this and then 
 	initializing clusters will change the cluster data structure.
 	Therefore, be careful not to change the cluster size _without_
@@ -105,27 +377,260 @@ private:
 	/* The log file */
 	std::fstream log;
 
+	/* The number of processors this process can actually use, allowing for
+	its affinity mask and any container CPU quota, unless overridden */
 	unsigned int cpu_count = 0;
 
+	/* The number of threads to split work across, or 0 for cpu_count */
+	unsigned int number_of_threads;
+
+	/* The worker threads, started on first use and kept for the life of the
+	object, unless a pool shared with other objects is given instead */
+	std::shared_ptr<tsThreadPool> pool;
+
+	/* Whether our own pool spreads its workers over the NUMA nodes */
+	bool numa_aware;
+
+	/* With a pool spread over more than one NUMA node, a copy of the clusters
+	(and of the transposed clusters, if used) in each node's local memory,
+	refreshed for every assignment step. Empty otherwise. */
+	std::vector<std::vector<T>> node_clusters;
+	std::vector<std::vector<T>> node_clusters_transposed;
+
 	/* Has a data point moved from one cluster assignment to another? */
 	unsigned int data_points_moved = std::numeric_limits<unsigned int>::max();
 
-	T compute_squared_distance(std::vector<T>& pointA, std::vector<T>& pointB);
+	/* Pointer to the first T value of the ith data point */
+	const T* point(unsigned int i) { return points + (size_t)i * row_stride; }
+
+	/* Pointer to the first T value of the ith cluster */
+	T* cluster(unsigned int i) { return &(*clusters)[(size_t)i * row_stride]; }
+
+	void transpose_clusters();
+	void seed_random_bounds();
+	void seed_kmeans_plus_plus();
+	void seed_kmeans_parallel();
+	void seed_mcmc();
+	tsThreadPool& thread_pool();
+	template <typename F> unsigned int parallel_for(unsigned int count, F work);
+	template <typename F> void parallel_for_chunks(unsigned int count, F work);
+	template <typename F> unsigned int assign_in_parallel(F assign_range);
+
+	/* The number of threads to split work across */
+	unsigned int thread_count() const 
+	{ 
+		if (pool)
+			return pool->size();
+		return number_of_threads ? number_of_threads : std::max(1u, cpu_count); 
+	}
+	void update_node_clusters();
+
+	/* The clusters for a worker to read, from its node's copy if there is one */
+	const T* local_clusters(unsigned int worker)
+	{
+		return node_clusters.empty() ? clusters->data() : node_clusters[pool->worker_node(worker)].data();
+	}
+	const T* local_clusters_transposed(unsigned int worker)
+	{
+		return node_clusters_transposed.empty() ? clusters_transposed.data() : node_clusters_transposed[pool->worker_node(worker)].data();
+	}
+
+	unsigned int nearest_cluster(const T* p, T& dsq);
+	void update_cluster_online(unsigned int c, const T* p);
+	void update_cluster_half_distances();
+	unsigned int assign_range_brute_force(unsigned int begin, unsigned int end, unsigned int worker);
+	unsigned int assign_range_elkan(unsigned int begin, unsigned int end, unsigned int worker, bool initialize_bounds);
+	unsigned int assign_range_hamerly(unsigned int begin, unsigned int end, unsigned int worker, bool initialize_bounds);
+	void update_max_shifts();
+	unsigned int assign_range_yinyang(unsigned int begin, unsigned int end, unsigned int worker, bool initialize_bounds);
+	void group_clusters_for_yinyang();
+	void update_group_shifts();
+	void build_kd_tree();
+	void update_norms();
+	unsigned int assign_range_gemm(unsigned int begin, unsigned int end, unsigned int worker);
+	unsigned int build_kd_node(unsigned int begin, unsigned int end);
+	unsigned int assign_kd_node(unsigned int node, size_t candidates_begin, size_t candidates_end);
+	void reset_cluster_sums(unsigned int slices = 1);
+	void accumulate_cluster_sums();
+	void reduce_cluster_sums();
+	bool update_cluster_sums_from_moves();
+
+	/* The number of slices to sum the data points in: no more than would
+	give each slice sum_slice_min_points points, or fewer points than there
+	are clusters, so summing a slice outweighs adding its block into the 
+	total, and no more blocks than fit in sum_slice_memory bytes */
+	unsigned int sum_slice_count() const
+	{
+		const size_t line = 64; // Cache line size in bytes
+		const size_t block_bytes = (size_t)number_of_clusters * (((stride * sizeof(T) + line - 1) / line) * line);
+		const unsigned int slice_points = std::max(number_of_clusters, (unsigned int)sum_slice_min_points);
+		const size_t by_memory = sum_slice_memory / std::max(block_bytes, (size_t)1);
+		unsigned int slices = std::min((unsigned int)sum_slices, number_of_points / slice_points);
+		if (by_memory < slices)
+			slices = (unsigned int)by_memory;
+		return std::max(1u, slices);
+	}
+
+	/* The running sums and count of cluster c in one block */
+	T* cluster_sum(unsigned int c, unsigned int block = 0)
+	{
+		return &cluster_sums[((size_t)block * number_of_clusters + c) * sum_row_stride];
+	}
+	unsigned int& cluster_count(unsigned int c, unsigned int block = 0)
+	{
+		return cluster_counts[(size_t)block * count_block_stride + c];
+	}
+
+	/* Add the ith data point into the running sums of cluster c */
+	void add_to_cluster_sums(unsigned int i, unsigned int c, unsigned int block = 0)
+	{
+		const T* p = point(i);
+		T* sum = cluster_sum(c, block);
+		for (unsigned int j = 0; j < dimensions(); j++)
+			sum[j] += p[j];
+		cluster_count(c, block)++;
+	}
+
+	/* Record that the ith data point is assigned to cluster c at squared
+	distance (or squared distance upper bound) dsq, adding it into the
+	cluster sums of its slice. Returns 1 if the point moved to a different
+	cluster. */
+	unsigned int finish_assignment(unsigned int i, unsigned int c, T dsq)
+	{
+		if (fuse_cluster_sums)
+			add_to_cluster_sums(i, c, i / sum_block_points);
+		return record_assignment(i, c, dsq);
+	}
+
+	/* As finish_assignment, but leaving the cluster sums to the caller */
+	unsigned int record_assignment(unsigned int i, unsigned int c, T dsq)
+	{
+		const unsigned int moved = ((*assignments)[i] != c) ? 1 : 0;
+		(*assignments)[i] = c;
+		(*distances)[i] = dsq;
+		return moved;
+	}
+
+	/* Bounds are nudged outward by a few units in the last place each time
+	they are derived, so that rounding can never make a bound prune a 
+	cluster that brute force would have picked */
+	static bound_type round_up(bound_type x) { return x * (1 + 4 * std::numeric_limits<bound_type>::epsilon()); }
+	static bound_type round_down(bound_type x) { return x * (1 - 4 * std::numeric_limits<bound_type>::epsilon()); }
+
+	/* The actual distance behind a squared distance, and the squared distance 
+	stored for a distance bound (rounded up for integer types) */
+	static bound_type bound_from_squared(T dsq) { return std::sqrt((bound_type)dsq); }
+	static T squared_from_bound(bound_type d) 
+	{
+		return std::numeric_limits<T>::is_integer ? (T)std::ceil(d * d) : (T)(d * d); 
+	}
+
+	/* Is squared distance dsq to cluster c a better assignment than squared
+	distance best_dsq to cluster best? Ties go to the lower cluster index, 
+	the same as a brute force scan in index order. */
+	static bool is_closer(T dsq, unsigned int c, T best_dsq, unsigned int best)
+	{
+		return dsq < best_dsq || (dsq == best_dsq && c < best);
+	}
+
+	/* The next T up from v, or v itself if there is none */
+	static T next_above(T v)
+	{
+		if (std::is_floating_point<T>::value)
+			return (T)std::nextafter(v, std::numeric_limits<T>::max());
+		return v < std::numeric_limits<T>::max() ? (T)(v + 1) : v;
+	}
+
+	/* The number of dimensions, known at compile time when N is set */
+	unsigned int dimensions() const { return N ? N : stride; }
+
+	/* The SIMD kernel for the squared distance picked for this processor,
+	or null to always use the scalar loop. Rows shorter than 
+	simd_min_dimensions aren't worth the call, and are left to the scalar 
+	loop, which unrolls completely for a small fixed N. */
+	typename tsDistanceKernels<T>::squared_distance_function distance_kernel;
+	static const unsigned int simd_min_dimensions = 8;
+
+	/* The SIMD kernel that finds the nearest of all the transposed clusters
+	to a point, for the processor, or null to use the scalar loop */
+	typename tsDistanceKernels<T>::nearest_transposed_function nearest_kernel;
+
+	/* For the partial distance search, the SIMD kernel that stops summing
+	once a distance reaches a limit, and whether to sum the dimensions in
+	decreasing order of variance. If so, dimension_order lists them in that
+	order, and is empty until worked out for the data set, ordered_points is
+	a copy of the data and ordered_clusters of the clusters with their
+	dimensions in that order, laid out the same as the originals. */
+	typename tsDistanceKernels<T>::bounded_distance_function bounded_kernel;
+	bool use_partial_distances;
+	bool use_variance_order;
+	std::vector<unsigned int> dimension_order;
+	placed_vector<T> ordered_points;
+	std::vector<T> ordered_clusters;
+
+	/* Is the partial distance search on, and of any use? Rows no longer than
+	one block of the kernel can't be given up on before the end. */
+	bool partial_search() const
+	{
+		return use_partial_distances && !use_transposed_clusters && dimensions() > tsDistanceKernels<T>::partial_block;
+	}
+
+	void update_dimension_order();
+	T compute_squared_distance(const T* pointA, const T* pointB);
+	T compute_partial_squared_distance(const T* pointA, const T* pointB, T limit);
 };
 
 /*
 Default constructor
 */
-template <typename T> tsClusters<T>::tsClusters()
+template <typename T, unsigned int N> tsClusters<T, N>::tsClusters()
 {
 	// By default we create this shared pointer, but we don't know the stride yet
 	// until the data is filled
-	data = std::make_shared<std::vector < data_structure >>(*(new std::vector< data_structure>));
-	clusters = std::make_shared<std::vector<std::vector<T>>>(*(new std::vector<std::vector<T>>));
-
+	data = std::make_shared<placed_vector<T>>();
+	assignments = std::make_shared<placed_vector<unsigned int>>();
+	distances = std::make_shared<placed_vector<T>>();
+	clusters = std::make_shared<std::vector<T>>();
+	use_transposed_clusters = false;
+	transposed_stride = 0;
+	cluster_sums_valid = false;
+	method = assign_brute_force;
+	initialization = init_random_bounds;
+	mcmc_chain_length = 200;
+	bounds_valid = false;
+	centroids_current = false;
+	number_of_groups = 0;
+	tree_valid = false;
+	point_norms_valid = false;
+	dimension_order.clear();
+	incremental_sums_valid = false;
+	stream_clusters_unplaced = 0;
+
+	points = nullptr;
+	number_of_points = 0;
 	stride = 0;
+	row_stride = 0;
+	row_alignment = 1;
 	number_of_clusters = 0;
-	cpu_count = std::thread::hardware_concurrency(); // Logical processor count
+	cpu_count = tsThreadPool::cpu_budget(); // Usable logical processor count
+	number_of_threads = 0;
+	numa_aware = false;
+	distance_kernel = tsDistanceKernels<T>::select();
+	nearest_kernel = tsDistanceKernels<T>::select_nearest_transposed();
+	dot4_kernel = tsDistanceKernels<T>::select_dot4();
+	bounded_kernel = tsDistanceKernels<T>::select_bounded();
+	use_partial_distances = false;
+	use_variance_order = false;
+	incremental_centroids = false;
+	tracking_moves = false;
+	moves_listed = false;
+	exact_recompute_interval = 0;
+	rounds_since_exact = 0;
+	fuse_cluster_sums = true;
+	sum_blocks = 0;
+	sum_block_points = 1;
+	sum_row_stride = 0;
+	count_block_stride = 0;
 
 #ifdef _DEBUG
 	log.open("debug.log", std::fstream::out);
@@ -133,7 +638,7 @@ template <typename T> tsClusters<T>::tsClusters()
 #endif
 }
 
-template <typename T> tsClusters<T>::~tsClusters()
+template <typename T, unsigned int N> tsClusters<T, N>::~tsClusters()
 {
 #ifdef _DEBUG
 	log << std::endl;
@@ -145,7 +650,7 @@ template <typename T> tsClusters<T>::~tsClusters()
 /*
 Templated copy constructor
 */
-template <typename T> tsClusters<T>::tsClusters(const tsClusters<T> &other)
+template <typename T, unsigned int N> tsClusters<T, N>::tsClusters(const tsClusters<T, N> &other)
 {
 #ifdef _DEBUG
 	log << "tsClusters copy constructor called.";
@@ -155,14 +660,26 @@ template <typename T> tsClusters<T>::tsClusters(const tsClusters<T> &other)
 /*
 Templated assignment operator
 */
-template <typename T> tsClusters<T>& tsClusters<T>::operator=(const tsClusters<T> &other)
+template <typename T, unsigned int N> tsClusters<T, N>& tsClusters<T, N>::operator=(const tsClusters<T, N> &other)
 {
 #ifdef _DEBUG
 	log << "tsClusters assignment operator called.";
 #endif
 
-	data.reset(new std::vector< data_structure>);
-	clusters.reset(new std::vector<std::vector<T>>);
+	data.reset(new placed_vector<T>);
+	assignments.reset(new placed_vector<unsigned int>);
+	distances.reset(new placed_vector<T>);
+	points = nullptr;
+	number_of_points = 0;
+	clusters.reset(new std::vector<T>);
+	clusters_transposed.clear();
+	cluster_sums_valid = false;
+	bounds_valid = false;
+	centroids_current = false;
+	tree_valid = false;
+	point_norms_valid = false;
+	dimension_order.clear();
+	incremental_sums_valid = false;
 	tsLock = other.tsLock;
 	return *this;
 }
@@ -170,35 +687,64 @@ template <typename T> tsClusters<T>& tsClusters<T>::operator=(const tsClusters<T
 /*
 Fill the data array with an array of variable type T of a given size, where stride is
 the dimension of the array.
-Obviously size%stride should be 0.
-Returns the size of the internal data vector
+Obviously size%stride should be 0, and any trailing partial point is ignored.
+The values are copied into one contiguous block, padding each row out to 
+row_stride with zeros.
+Returns the number of T values (excluding padding) in the internal data vector
 */
-template <typename T> unsigned int tsClusters<T>::fill_data_array(T* input_data, unsigned int input_size, unsigned int input_stride)
+template <typename T, unsigned int N> unsigned int tsClusters<T, N>::fill_data_array(T* input_data, unsigned int input_size, unsigned int input_stride)
 {
-	if(!input_data || !input_size || !input_stride)
+	if(!input_data || !input_size || !input_stride || input_size < input_stride)
+		return 0;
+
+	if (N && input_stride != N)
 		return 0;
 	
 	number_of_clusters = input_stride; // To begin, we assume this, but the user can change it
 	stride = input_stride; // This should be internally consistent everywhere
+	row_stride = ((stride + row_alignment - 1) / row_alignment) * row_alignment;
+	number_of_points = input_size / stride;
+	bounds_valid = false;
+	centroids_current = false;
+	tree_valid = false;
+	point_norms_valid = false;
+	dimension_order.clear();
+	incremental_sums_valid = false;
 
 	std::lock_guard<std::mutex> lock(tsLock);
 
 	try
 	{
-		for (unsigned int i = 0; i < input_size; i++)
+		if (numa_aware)
 		{
-			data_structure ds;
-			ds.p.push_back(input_data[i]);
-			// Fill this row to the stride
-			while (ds.p.size() < stride)
-			{				
-				i++;
-				ds.p.push_back(input_data[i]);
-			}
+			// Start from fresh, untouched memory, and let each worker copy in
+			// its own slice of the points so it lands in that worker's node
+			data = std::make_shared<placed_vector<T>>((size_t)number_of_points * row_stride);
+			assignments = std::make_shared<placed_vector<unsigned int>>(number_of_points);
+			distances = std::make_shared<placed_vector<T>>(number_of_points);
+			points = data->data();
+
+			parallel_for(number_of_points, [&](unsigned int begin, unsigned int end, unsigned int)
+			{
+				for (unsigned int i = begin; i < end; i++)
+				{
+					T* row = &(*data)[(size_t)i * row_stride];
+					memcpy(row, &input_data[(size_t)i * stride], sizeof(T) * stride);
+					std::fill(row + stride, row + row_stride, (T)0);
+					(*assignments)[i] = 0;
+					(*distances)[i] = std::numeric_limits<T>::max();
+				}
+			});
+		}
+		else
+		{
+			data->assign((size_t)number_of_points * row_stride, 0);
+			assignments->assign(number_of_points, 0);
+			distances->assign(number_of_points, std::numeric_limits<T>::max());
+			points = data->data();
 
-			ds.ci = 0;
-			ds.distance_squared = std::numeric_limits<T>::max();
-			data->push_back(ds);
+			for (unsigned int i = 0; i < number_of_points; i++)
+				memcpy(&(*data)[(size_t)i * row_stride], &input_data[(size_t)i * stride], sizeof(T) * stride);
 		}
 	}
 	catch (std::exception e)
@@ -206,6 +752,7 @@ template <typename T> unsigned int tsClusters<T>::fill_data_array(T* input_data,
 #ifdef _DEBUG
 		log << "Exception in fill_data_array: " << e.what() << std::endl;
 #endif
+		number_of_points = 0;
 		return 0;
 	}
 
@@ -214,23 +761,100 @@ template <typename T> unsigned int tsClusters<T>::fill_data_array(T* input_data,
 	log << std::endl << std::endl;
 	log << "Data points: " << std::endl;
 
-	for(auto it=data->begin(); it!=data->end(); it++)
+	for (unsigned int i = 0; i < number_of_points; i++)
 	{
-		for (auto it_p = it->p.begin(); it_p != it->p.end(); it_p++)
-			log << *it_p << "\t";
+		const T* p = point(i);
+		for (unsigned int j = 0; j < stride; j++)
+			log << p[j] << "\t";
 
 		log << std::endl;
 	}
 #endif
 
-	return (unsigned int)(data->size() * data->begin()->p.size());
+	return number_of_points * stride;
+}
+
+/*
+Set up the data set as a view over a caller-owned buffer of size T values,
+where stride is the dimension of each point and row_stride is the distance in
+T values from one point to the next in the buffer (0 meaning the same as
+stride). Nothing is copied: the buffer is read in place by every later call,
+so it must stay valid and unchanged until fill_data_array or fill_data_view
+is called again, or this object is destroyed. Any padding values past stride
+in each row are never read.
+The cluster assignments and the clusters themselves are still owned here.
+Returns the number of T values (excluding padding) in the data set
+*/
+template <typename T, unsigned int N> unsigned int tsClusters<T, N>::fill_data_view(const T* input_data, unsigned int input_size, unsigned int input_stride, unsigned int input_row_stride)
+{
+	if (!input_row_stride)
+		input_row_stride = input_stride;
+
+	if (!input_data || !input_stride || input_row_stride < input_stride || input_size < input_stride)
+		return 0;
+
+	if (N && input_stride != N)
+		return 0;
+
+	std::lock_guard<std::mutex> lock(tsLock);
+
+	try
+	{
+		assignments->assign(input_size / input_row_stride + (input_size % input_row_stride >= input_stride ? 1 : 0), 0);
+		distances->assign(assignments->size(), std::numeric_limits<T>::max());
+	}
+	catch (std::exception e)
+	{
+#ifdef _DEBUG
+		log << "Exception in fill_data_view: " << e.what() << std::endl;
+#endif
+		number_of_points = 0;
+		return 0;
+	}
+
+	number_of_clusters = input_stride; // To begin, we assume this, but the user can change it
+	stride = input_stride;
+	row_stride = input_row_stride;
+	number_of_points = (unsigned int)assignments->size();
+	bounds_valid = false;
+	centroids_current = false;
+	tree_valid = false;
+	point_norms_valid = false;
+	dimension_order.clear();
+	incremental_sums_valid = false;
+
+	// Release any previously copied data, as the view replaces it
+	data->clear();
+	data->shrink_to_fit();
+	points = input_data;
+
+#ifdef _DEBUG
+	log << std::endl << std::endl;
+	log << "Data view over " << number_of_points << " points of stride " << stride;
+	log << " and row stride " << row_stride << std::endl;
+#endif
+
+	return number_of_points * stride;
+}
+
+/*
+Set the row alignment, in T values, used to pad each data point in the 
+internal data vector. For example, an alignment of 8 with float data puts
+every point on a 32 byte boundary relative to the start of the data. 
+This only takes effect on the next call to fill_data_array, as a view made
+by fill_data_view always uses the caller's row stride.
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::set_row_alignment(unsigned int alignment)
+{
+	if (alignment)
+		row_alignment = alignment;
 }
 
 /*
 Set the desired number of clusters.
 If this isn't called, number of clusters will default to the number of dimensions. 
 */
-template <typename T> void tsClusters<T>::set_number_of_clusters(unsigned int input_number)
+template <typename T, unsigned int N> void tsClusters<T, N>::set_number_of_clusters(unsigned int input_number)
 {
 #ifdef _DEBUG
 	log << "Setting the number of clusters to " << input_number;
@@ -238,48 +862,94 @@ template <typename T> void tsClusters<T>::set_number_of_clusters(unsigned int in
 
 	if(input_number)
 		number_of_clusters = input_number;
+
+	bounds_valid = false;
+	centroids_current = false;
+	cluster_sums_valid = false;
+	incremental_sums_valid = false;
 }
 
 /*
-Initalize the clusters to a new starting position, based on the min and max
-of each dimension (of which there are N dimensions, where N is the stride)
+Initalize the clusters to a new starting position, either at random within
+the min and max of each dimension (of which there are N dimensions, where N is
+the stride), or on data points chosen by k-means++, as set by 
+set_initialization_method
 TODO: Test this more thorougly
 */
-template <typename T> void tsClusters<T>::initialize_clusters()
+template <typename T, unsigned int N> void tsClusters<T, N>::initialize_clusters()
 {
 	if (!stride || !number_of_clusters)
 		return;
 
 	std::lock_guard<std::mutex> lock(tsLock);
 
+	// Size the cluster matrix, zeroing any row padding
+	clusters->assign((size_t)number_of_clusters * row_stride, 0);
+	cluster_update_counts.assign(number_of_clusters, 0);
+	stream_clusters_unplaced = 0;
+	bounds_valid = false;
+	centroids_current = false;
+
+	if (initialization == init_kmeans_plus_plus && number_of_points)
+		seed_kmeans_plus_plus();
+	else if (initialization == init_kmeans_parallel && number_of_points)
+		seed_kmeans_parallel();
+	else if (initialization == init_mcmc && number_of_points)
+		seed_mcmc();
+	else
+		seed_random_bounds();
+
+	if (use_transposed_clusters)
+		transpose_clusters();
+
+	// TODO: Test for minimum safe distance...
+
+#ifdef _DEBUG
+	log << std::endl << std::endl;
+	log << "Cluster starting positions:" << std::endl;
+
+	for (unsigned int cluster_index = 0; cluster_index < number_of_clusters; cluster_index++)
+	{
+		log << std::endl;
+		log << "Cluster " << cluster_index << ":" << std::endl;
+		log << "     ";
+
+		// The cluster points
+		const T* cp = cluster(cluster_index);
+		for (unsigned int j = 0; j < stride; j++)
+			log << cp[j] << " ";
+	}
+
+	log << std::endl;
+#endif
+	
+}
+
+/*
+Place every cluster at random within the bounds of the data in each dimension
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::seed_random_bounds()
+{
 	// Find the upper and lower bound of each dimension in the data vector
 	T* ub = new T[stride];
 	T* lb = new T[stride];
 
 	for (unsigned int j = 0; j < stride; j++)
 	{
-		ub[j] = std::numeric_limits<T>::min();
+		ub[j] = std::numeric_limits<T>::lowest();
 		lb[j] = std::numeric_limits<T>::max();
 	}
 
-	std::vector<data_structure>::iterator it = data->begin();
-
-	while (it != data->end())
+	for (unsigned int i = 0; i < number_of_points; i++)
 	{
-		std::vector<T>::iterator it_t = it->p.begin();
-		unsigned int i = 0;
-		while (it_t != it->p.end())
+		const T* p = point(i);
+		for (unsigned int j = 0; j < stride; j++)
 		{
-			if (*it_t > ub[i])
-				ub[i] = *it_t;
-			if (*it_t < lb[i])
-				lb[i] = *it_t;
-
-			i++;
-			it_t++;
+			if (p[j] > ub[j])
+				ub[j] = p[j];
+			if (p[j] < lb[j])
+				lb[j] = p[j];
 		}
-
-		it++;
 	}
 
 	// We should now have a lower and upper bound for every dimension in
@@ -288,197 +958,2210 @@ template <typename T> void tsClusters<T>::initialize_clusters()
 	// For every cluster...
 	for (unsigned int idx_c = 0; idx_c < number_of_clusters; idx_c++)
 	{
-		// Create a new cluster point...
-		std::vector<T> cp;
+		// Find the row for this cluster point...
+		T* cp = cluster(idx_c);
 
 		// ... and for every dimension of input (stride)...
 		for (unsigned int idx_s = 0; idx_s < stride; idx_s++)
 		{
-			// ...put a random value into the clusters vector that is between the
+			// ...put a random value into the clusters matrix that is between the
 			// lower bound and upper bound of this particular dimension
 			// Using fmod from cmath as modulo is not defined for float
-			cp.push_back((T)(std::fmod(rand(), (ub[idx_s] - lb[idx_s]))) + lb[idx_s]);
-
+			cp[idx_s] = (T)(std::fmod(rand(), (ub[idx_s] - lb[idx_s]))) + lb[idx_s];
 		}
-		// Then add this point and move on to the next cluster...
-		clusters->push_back(cp);
 	}
 
-	// TODO: Test for minimum safe distance...
+	delete[] ub;
+	delete[] lb;
+}
 
-#ifdef _DEBUG
-	log << std::endl << std::endl;
-	log << "Cluster starting positions:" << std::endl;
+/*
+Place the clusters on data points chosen by k-means++ (Arthur and Vassilvitskii,
+"k-means++: The Advantages of Careful Seeding", 2007). The first is picked 
+uniformly at random, and each one after that with probability proportional to
+the squared distance from the point to the nearest cluster already placed. 
+That running minimum is kept in each point's distance, and updated in parallel
+across the points as each cluster is placed.
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::seed_kmeans_plus_plus()
+{
+	std::uniform_int_distribution<unsigned int> pick(0, number_of_points - 1);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
 
-	unsigned int cluster_index = 0;
+	// The sum of the distances over each thread's range of points, and where
+	// each range starts, so a sample can be found without a serial pass
+	std::vector<double> range_sums(thread_count());
+	std::vector<unsigned int> range_begins(range_sums.size());
 
-	// The clusters
-	std::vector<std::vector<T>>::iterator it_c = clusters->begin();
+	unsigned int chosen = pick(random_engine);
 
-	while (it_c != clusters->end())
+	for (unsigned int c = 0; c < number_of_clusters; c++)
 	{
-		log << std::endl;
-		log << "Cluster " << cluster_index << ":" << std::endl;
-		log << "     ";
+		memcpy(cluster(c), point(chosen), sizeof(T) * stride);
 
-		// The cluster points
-		std::vector<T>::iterator it_cp = it_c->begin();
+		if (c + 1 == number_of_clusters)
+			break;
+
+		// Bring each point's distance to the nearest cluster up to date
+		const T* cp = cluster(c);
+		const unsigned int number_of_ranges = parallel_for(number_of_points, [&](unsigned int begin, unsigned int end, unsigned int t)
+		{
+			double sum = 0;
+			for (unsigned int i = begin; i < end; i++)
+			{
+				const T dsq = compute_squared_distance(point(i), cp);
+				if (c == 0 || dsq < (*distances)[i])
+					(*distances)[i] = dsq;
+				sum += (*distances)[i];
+			}
+
+			range_sums[t] = sum;
+			range_begins[t] = begin;
+		});
 
-		while (it_cp != it_c->end())
+		double total = 0;
+		for (unsigned int t = 0; t < number_of_ranges; t++)
+			total += range_sums[t];
+
+		// Every point already sits on a cluster, so any will do
+		if (!(total > 0))
 		{
-			log << *it_cp << " ";
-			it_cp++;
+			chosen = pick(random_engine);
+			continue;
 		}
 
-		cluster_index++;
-		it_c++;
-	}
+		// Find the range the sample falls in, then the point within it
+		double target = uniform(random_engine) * total;
+		unsigned int t = 0;
+		while (t + 1 < number_of_ranges && target >= range_sums[t])
+		{
+			target -= range_sums[t];
+			t++;
+		}
 
-	log << std::endl;
-#endif
-	
+		const unsigned int range_end = (t + 1 < number_of_ranges) ? range_begins[t + 1] : number_of_points;
+		chosen = range_end - 1;
+		for (unsigned int i = range_begins[t]; i < range_end; i++)
+		{
+			if (target < (*distances)[i])
+			{
+				chosen = i;
+				break;
+			}
+			target -= (*distances)[i];
+		}
+	}
 }
 
 /*
-For every data point, find the closest cluster to it, and assign that one to it.
+Place the clusters on data points chosen by k-means|| (Bahmani et al., "Scalable
+K-Means++", 2012). Rather than one pass over the data per cluster, a handful of
+rounds each sample about 2k candidate points independently and in parallel, 
+with probability proportional to the squared distance to the nearest candidate
+so far (kept in each point's distance, along with which candidate that is). 
+Each candidate is then weighted by the number of points nearest to it, and k of
+them are picked by weighted k-means++ over the much smaller candidate set.
+The points are sampled in fixed blocks, each with its own generator seeded from
+the block's index, so the candidates are the same for any number of threads.
 */
-template <typename T> void tsClusters<T>::assign_clusters()
+template <typename T, unsigned int N> void tsClusters<T, N>::seed_kmeans_parallel()
 {
-	data_points_moved = 0;
+	const unsigned int rounds = 5;
+	const double oversampling = 2.0 * number_of_clusters;
 
-	T computed_distance = 0; // Accumulator for the (p1-q1)^2 part of the distance computation
-	
-	unsigned int current_cluster_index = 0; // For keeping track of which cluster we're checking
-	unsigned int closest_cluster_index = 0; // For keeping track of which was the closest cluster so far
-	T closest_cluster_distance = std::numeric_limits<T>::max();
+	std::uniform_int_distribution<unsigned int> pick(0, number_of_points - 1);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
 
-	// For every data point in the data vector...
-	for (auto dp_it = data->begin(); dp_it != data->end(); dp_it++)
-	{
-		current_cluster_index = 0;
-		closest_cluster_distance = std::numeric_limits<T>::max();;
+	// Each block of points samples into its own list, with its own generator,
+	// and sums its own distances, so nothing depends on which thread runs it
+	const unsigned int block_points = 4096;
+	const unsigned int blocks = (number_of_points + block_points - 1) / block_points;
+	std::vector<std::vector<unsigned int>> block_candidates(blocks);
+	std::vector<double> block_sums(blocks);
 
-		// ...compare to every cluster point...
-		for (auto cp_it = clusters->begin(); cp_it != clusters->end(); cp_it++)
-		{
-			computed_distance = 0;
+	// The index in candidates of the one nearest each point
+	std::vector<unsigned int> nearest_candidate(number_of_points, 0);
 
-			/*****************
-			Basically we're doing an N-dimensional distance comparison, to find
-			the index of the cluster that is the closest to the data point.
-			Using a distance formula like this:
-			distance(p,q) = sqrt((p1-q1)^2 + (p2-q2)^2 + ... + (pN-qN)^2)
-			Except we don't need to bother with the expensive sqrt operation.
-			So in this inner loop we're just accumulating the various (p1-q1)^2
-			result for each cluster and data point T value.
-			NOTE: The count of it_p's should match the count of it_cp's because
-			of internal consistency checks for stride.
-			******************/
-			computed_distance = compute_squared_distance(dp_it->p, *cp_it);
+	std::vector<unsigned int> candidates(1, pick(random_engine));
+	size_t new_begin = 0;
+	double cost = 0;
 
-			if (computed_distance < closest_cluster_distance)
+	for (unsigned int round = 0; round <= rounds; round++)
+	{
+		// Bring each point's distance to the nearest candidate up to date
+		// with the candidates added last round
+		const size_t new_end = candidates.size();
+		thread_pool().run(blocks, [&](unsigned int block, unsigned int)
+		{
+			const unsigned int begin = block * block_points;
+			const unsigned int end = std::min(number_of_points, begin + block_points);
+			double sum = 0;
+			for (unsigned int i = begin; i < end; i++)
 			{
-				closest_cluster_distance = computed_distance;
-				closest_cluster_index = current_cluster_index;
+				T nearest = (new_begin == 0) ? std::numeric_limits<T>::max() : (*distances)[i];
+				for (size_t ci = new_begin; ci < new_end; ci++)
+				{
+					const T dsq = compute_squared_distance(point(i), point(candidates[ci]));
+					if (dsq < nearest || ci == 0)
+					{
+						nearest = dsq;
+						nearest_candidate[i] = (unsigned int)ci;
+					}
+				}
+
+				(*distances)[i] = nearest;
+				sum += nearest;
 			}
+			block_sums[block] = sum;
+		});
+		new_begin = new_end;
 
-			current_cluster_index++;
+		cost = 0;
+		for (unsigned int block = 0; block < blocks; block++)
+			cost += block_sums[block];
 
-		} // end for every cluster
+		if (round == rounds || !(cost > 0))
+			break;
 
-		// Test and set the movement flag if the cluster changed this round
-		// (this is tested and skipped if it's already true)
-		if (dp_it->ci != closest_cluster_index)
-			data_points_moved++;
+		// Sample each point independently
+		const unsigned int seed = random_engine();
+		thread_pool().run(blocks, [&](unsigned int block, unsigned int)
+		{
+			std::seed_seq block_seed = { seed, block };
+			std::mt19937 block_engine(block_seed);
+			std::uniform_real_distribution<double> block_uniform(0.0, 1.0);
+			block_candidates[block].clear();
+
+			const unsigned int begin = block * block_points;
+			const unsigned int end = std::min(number_of_points, begin + block_points);
+			for (unsigned int i = begin; i < end; i++)
+				if (block_uniform(block_engine) * cost < oversampling * (*distances)[i])
+					block_candidates[block].push_back(i);
+		});
+
+		for (unsigned int block = 0; block < blocks; block++)
+			candidates.insert(candidates.end(), block_candidates[block].begin(), block_candidates[block].end());
+
+		if (candidates.size() == new_begin)
+			break;
+	}
 
-		// Assign the cluster index to this data point
-		dp_it->ci = closest_cluster_index;
-		dp_it->distance_squared = closest_cluster_distance;
-		
-	} // end for every data point
+	// Weight each candidate by the number of points nearest to it, as found
+	// while the rounds kept the distances up to date
+	const size_t m = candidates.size();
+	std::vector<std::vector<unsigned int>> range_weights(thread_count());
+	const unsigned int used = parallel_for(number_of_points, [&](unsigned int begin, unsigned int end, unsigned int t)
+	{
+		range_weights[t].assign(m, 0);
+		for (unsigned int i = begin; i < end; i++)
+			range_weights[t][nearest_candidate[i]]++;
+	});
+
+	std::vector<double> weights(m, 0);
+	for (unsigned int t = 0; t < used; t++)
+		for (size_t ci = 0; ci < m; ci++)
+			weights[ci] += range_weights[t][ci];
+
+	// Weighted k-means++ over the candidates
+	std::vector<double> nearest(m, std::numeric_limits<double>::max());
+	size_t chosen = 0;
+	for (unsigned int c = 0; c < number_of_clusters; c++)
+	{
+		// Once the candidates run out, fall back to random data points
+		const T* source = (c < m) ? point(candidates[chosen]) : point(pick(random_engine));
+		memcpy(cluster(c), source, sizeof(T) * stride);
+
+		double total = 0;
+		for (size_t ci = 0; ci < m; ci++)
+		{
+			nearest[ci] = std::min(nearest[ci], (double)compute_squared_distance(point(candidates[ci]), cluster(c)));
+			total += weights[ci] * nearest[ci];
+		}
+
+		// Every candidate already sits on a cluster, so any will do
+		if (!(total > 0))
+		{
+			chosen = std::uniform_int_distribution<size_t>(0, m - 1)(random_engine);
+			continue;
+		}
+
+		double target = uniform(random_engine) * total;
+		chosen = m - 1;
+		for (size_t ci = 0; ci < m; ci++)
+		{
+			if (target < weights[ci] * nearest[ci])
+			{
+				chosen = ci;
+				break;
+			}
+			target -= weights[ci] * nearest[ci];
+		}
+	}
 }
 
-/* 
-Given a set of data points with clusters assigned, compute new cluster
-positions as the centroid of all the points assigned to that cluster.
-If a cluster has no points assigned, it needs to be moved to a new 
-random location. 
+/*
+Place the clusters on data points chosen by AFK-MC^2 (Bachem et al., "Fast and
+Provably Good Seedings for k-Means", 2016), which approximates k-means++ without
+a pass over the data per cluster. After the first cluster is picked uniformly
+at random, one parallel pass finds each point's squared distance to it (kept 
+in each point's distance) to build a proposal distribution that mixes that 
+distance with a uniform pick. Each further cluster then runs a Markov chain of
+mcmc_chain_length proposals, accepting a proposed point over the current one
+by the ratio of their distances to the clusters placed so far, corrected for
+the proposal. The cost per cluster depends on the chain length and k, not on 
+the number of data points. Each proposal is drawn by a binary search over the
+running sum of fixed blocks of points, then a scan within the one block.
 */
-template <typename T> void tsClusters<T>::compute_centroids()
+template <typename T, unsigned int N> void tsClusters<T, N>::seed_mcmc()
 {
-	if (!stride || !number_of_clusters)
-		return;
-		
-	// Outside loop is each cluster by index
-	for (unsigned int i = 0; i < number_of_clusters; i++)
-	{		
-		T* accum = new T[stride]; // accumulator for each data point
-		memset(accum, 0, sizeof(T) * stride);
+	std::uniform_int_distribution<unsigned int> pick(0, number_of_points - 1);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
 
-		unsigned int data_point_counter = 0;
+	memcpy(cluster(0), point(pick(random_engine)), sizeof(T) * stride);
+	if (number_of_clusters == 1)
+		return;
 
-		std::vector<data_structure>::iterator ds_iter = data->begin();
-		while (ds_iter != data->end())
+	// Squared distance to the first cluster, and the sum of them over each
+	// block of points
+	const unsigned int block_points = 1024;
+	const unsigned int blocks = (number_of_points + block_points - 1) / block_points;
+	std::vector<double> block_sums(blocks);
+	const T* first = cluster(0);
+	thread_pool().run(blocks, [&](unsigned int block, unsigned int)
+	{
+		const unsigned int begin = block * block_points;
+		const unsigned int end = std::min(number_of_points, begin + block_points);
+		double sum = 0;
+		for (unsigned int i = begin; i < end; i++)
 		{
-			if (ds_iter->ci == i)
-			{
-				data_point_counter++; // Used later to compute the mean
+			(*distances)[i] = compute_squared_distance(point(i), first);
+			sum += (*distances)[i];
+		}
+		block_sums[block] = sum;
+	});
+
+	double total = 0;
+	for (unsigned int block = 0; block < blocks; block++)
+		total += block_sums[block];
+
+	// The proposal q(x) = d(x, c1)^2 / (2 * total) + 1 / (2 * n), laid out as a 
+	// running sum over the blocks
+	const double uniform_share = 0.5 / number_of_points;
+	const double distance_share = (total > 0) ? 0.5 / total : 0;
+	auto proposal = [&](unsigned int i) -> double
+	{
+		return (total > 0) ? (*distances)[i] * distance_share + uniform_share : 1.0 / number_of_points;
+	};
 
-				unsigned int Tcounter = 0;
-				for (auto& iter : ds_iter->p)
-				{
-					accum[Tcounter] += iter;
-					Tcounter++;
-				}				
-			}
-			ds_iter++;
-		} // End for each data point by iterator
+	std::vector<double> cumulative(blocks);
+	double running = 0;
+	for (unsigned int block = 0; block < blocks; block++)
+	{
+		const unsigned int count = std::min(number_of_points - block * block_points, block_points);
+		running += (total > 0) ? block_sums[block] * distance_share + count * uniform_share : (double)count / number_of_points;
+		cumulative[block] = running;
+	}
+
+	auto draw = [&]() -> unsigned int
+	{
+		double target = uniform(random_engine) * running;
+		const unsigned int block = (unsigned int)std::min<size_t>(std::upper_bound(cumulative.begin(), cumulative.end(), target) - cumulative.begin(), blocks - 1);
+		if (block)
+			target -= cumulative[block - 1];
 
-		// Now update the ith cluster position as the mean
-		// of the accumulator for each T value
-		unsigned int j = 0;
-		auto cp_iter = clusters->begin();
-		// Move out to the iterator of the current index in the outside loop
-		while (j != i && cp_iter != clusters->end())
+		const unsigned int end = std::min(number_of_points, (block + 1) * block_points);
+		for (unsigned int i = block * block_points; i < end; i++)
 		{
-			j++;
-			cp_iter++;
+			if (target < proposal(i))
+				return i;
+			target -= proposal(i);
 		}
-		
-		// Compute the mean of each accumulator and store it as the new
-		// set of T values in the cluster
-		j = 0;
-		std::vector<T>::iterator Tval_iter = cp_iter->begin();
-		while (Tval_iter != cp_iter->end())
+		return end - 1;
+	};
+	auto nearest_placed = [&](unsigned int i, unsigned int placed) -> double
+	{
+		T nearest = std::numeric_limits<T>::max();
+		for (unsigned int c = 0; c < placed; c++)
+			nearest = std::min(nearest, compute_squared_distance(point(i), cluster(c)));
+		return nearest;
+	};
+
+	for (unsigned int c = 1; c < number_of_clusters; c++)
+	{
+		unsigned int x = draw();
+		double x_dsq = nearest_placed(x, c);
+
+		for (unsigned int step = 1; step < mcmc_chain_length; step++)
 		{
-			*Tval_iter = accum[j] / data_point_counter;
-			j++;
-			Tval_iter++;
-		}			
+			const unsigned int y = draw();
+			const double y_dsq = nearest_placed(y, c);
 
-		delete accum;
+			// Accept y with probability min(1, (d(y)^2 q(x)) / (d(x)^2 q(y)))
+			const double x_weight = x_dsq * proposal(y);
+			if (x_weight <= 0 || y_dsq * proposal(x) > uniform(random_engine) * x_weight)
+			{
+				x = y;
+				x_dsq = y_dsq;
+			}
+		}
 
-	} // End for each cluster by index
-	
+		memcpy(cluster(c), point(x), sizeof(T) * stride);
+	}
 }
 
-/* Compute the squared distance, ignoring the expensive sqrt operation. 
-Useful for comparing without worrying about the _actual_ distance of the two points.
-If you want the _actual_ distance, just sqrt the return value of this. */
-template <typename T> T tsClusters<T>::compute_squared_distance(std::vector<T>& pointA, std::vector<T>& pointB)
+/*
+Return the thread pool, starting one of our own if there isn't one yet
+*/
+template <typename T, unsigned int N> tsThreadPool& tsClusters<T, N>::thread_pool()
 {
-	T accum = 0;
-	std::vector<T>::iterator it_a = pointA.begin();
-	std::vector<T>::iterator it_b = pointB.begin();
+	if (!pool)
+		pool = std::make_shared<tsThreadPool>(thread_count(), numa_aware);
+
+	return *pool;
+}
+
+/*
+Run work(begin, end, piece) over the range [0, count), split into one contiguous
+piece per worker thread, numbered in order. The pieces are the same from run to
+run, whichever thread ends up running each one, so results kept per piece can be
+combined in a repeatable order.
+Returns the number of pieces.
+*/
+template <typename T, unsigned int N> template <typename F> unsigned int tsClusters<T, N>::parallel_for(unsigned int count, F work)
+{
+	const unsigned int pieces = std::min(thread_count(), std::max(1u, count));
+	auto run_piece = [&](unsigned int piece)
+	{
+		const unsigned int begin = (unsigned int)((unsigned long long)count * piece / pieces);
+		const unsigned int end = (unsigned int)((unsigned long long)count * (piece + 1) / pieces);
+		work(begin, end, piece);
+	};
 
-	while (it_a != pointA.end() && it_b != pointB.end())
+	// Spread over NUMA nodes, each worker always runs the piece of its own 
+	// number, so the same points are handled on the same node every time
+	if (thread_pool().node_count() > 1 && pieces == pool->size())
+		pool->run_on_each_worker(run_piece);
+	else
 	{
-		accum += (*it_a - *it_b) * (*it_a - *it_b);
-		it_a++;
-		it_b++;
+		pool->run(pieces, [&](unsigned int piece, unsigned int)
+		{
+			run_piece(piece);
+		});
 	}
 
-	return accum;
+	return pieces;
+}
+
+/*
+Run work(begin, end, worker) over the range [0, count), split into many small 
+chunks that the worker threads balance between themselves by work stealing. 
+A worker may run any number of chunks, so anything kept per worker needs to
+be added to rather than set. Suits work that takes much longer for some points
+than others, like the bound-based assignment methods.
+*/
+template <typename T, unsigned int N> template <typename F> void tsClusters<T, N>::parallel_for_chunks(unsigned int count, F work)
+{
+	// Around sixteen chunks per worker, but not so small the overhead shows
+	const unsigned int chunk = std::max(256u, count / (16 * thread_count()));
+	const unsigned int chunks = (count + chunk - 1) / chunk;
+
+	thread_pool().run(chunks, [&](unsigned int c, unsigned int worker)
+	{
+		work(c * chunk, std::min(count, (c + 1) * chunk), worker);
+	});
+}
+
+/*
+Set the number of worker threads, where 0 means one per usable processor.
+This replaces any thread pool in use with a new one of our own.
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::set_number_of_threads(unsigned int threads)
+{
+	number_of_threads = threads;
+	pool.reset();
+}
+
+/*
+Set the number of processors to size our own thread pool by, when the number
+of threads is left at 0, overriding the detected CPU budget. For example, when
+the quota is shared with other work in the same container. Passing 0 detects 
+it again. This replaces any thread pool in use with a new one of our own.
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::set_cpu_count(unsigned int count)
+{
+	cpu_count = count ? count : tsThreadPool::cpu_budget();
+	pool.reset();
+}
+
+/*
+Run all the parallel work on a thread pool that may be shared with other 
+objects, which then sets the number of worker threads. Passing an empty 
+pointer goes back to a pool of our own.
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::set_thread_pool(std::shared_ptr<tsThreadPool> shared_pool)
+{
+	pool = shared_pool;
+}
+
+/*
+Turn NUMA awareness on or off for our own thread pool. When on, the workers
+are spread over the NUMA nodes and pinned there, fill_data_array places each
+worker's slice of the data in its own node's memory, and each node gets its
+own copy of the clusters to read while assigning. On a machine with a single
+node this makes no difference. A pool given to set_thread_pool decides this
+for itself, and this replaces it with a new one of our own.
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::set_numa_aware(bool enable)
+{
+	numa_aware = enable;
+	pool.reset();
+}
+
+/*
+When the pool is spread over more than one NUMA node, copy the clusters out 
+to each node, on the first worker of that node, so they land in its memory
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::update_node_clusters()
+{
+	if (thread_pool().node_count() <= 1)
+	{
+		node_clusters.clear();
+		node_clusters_transposed.clear();
+		return;
+	}
+
+	node_clusters.resize(pool->node_count());
+	node_clusters_transposed.resize(use_transposed_clusters ? pool->node_count() : 0);
+
+	pool->run_on_each_worker([&](unsigned int worker)
+	{
+		const unsigned int node = pool->worker_node(worker);
+		if (worker && pool->worker_node(worker - 1) == node)
+			return;
+
+		node_clusters[node] = *clusters;
+		if (use_transposed_clusters)
+			node_clusters_transposed[node] = clusters_transposed;
+	});
+}
+
+/*
+For every data point, find the closest cluster to it, and assign that one to it.
+As each point is assigned, it is also added into the running sums for its
+cluster, so the following compute_centroids is just a divide per cluster.
+With incremental centroids, once there are sums for the last assignments,
+only the points that moved are taken out of one sum and added to another.
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::assign_clusters()
+{
+	if (!stride || !number_of_clusters)
+		return;
+
+	// Nothing to assign to until the clusters are initialized for this many
+	if (clusters->size() < (size_t)number_of_clusters * row_stride)
+		return;
+
+	// The k-d tree assigns whole cells at once, so can't list the moves
+	tracking_moves = method != assign_kd_tree;
+	moves_listed = false;
+	moved_points.clear();
+	const bool incremental = tracking_moves && incremental_centroids && incremental_sums_valid &&
+		!(exact_recompute_interval && rounds_since_exact >= exact_recompute_interval);
+
+	update_node_clusters();
+
+	// With more than one thread the sums are left for compute_centroids
+	fuse_cluster_sums = !incremental && ((method == assign_kd_tree) || std::min(thread_count(), number_of_points) <= 1);
+	if (fuse_cluster_sums)
+		reset_cluster_sums((method == assign_kd_tree) ? 1 : sum_slice_count());
+
+	// The bounds only need loosening for the clusters that moved
+	moved_clusters.clear();
+	if (bounds_valid)
+	{
+		for (unsigned int c = 0; c < number_of_clusters; c++)
+		{
+			if (cluster_shift[c] > 0)
+				moved_clusters.push_back(c);
+		}
+	}
+
+	switch (method)
+	{
+	case assign_elkan:
+	{
+		const bool initialize_bounds = !bounds_valid;
+		if (initialize_bounds)
+			lower_bounds.resize((size_t)number_of_points * number_of_clusters);
+
+		update_cluster_half_distances();
+		data_points_moved = assign_in_parallel([&](unsigned int begin, unsigned int end, unsigned int worker)
+		{
+			return assign_range_elkan(begin, end, worker, initialize_bounds);
+		});
+		break;
+	}
+	case assign_hamerly:
+	{
+		const bool initialize_bounds = !bounds_valid;
+		if (initialize_bounds)
+			lower_bounds.resize(number_of_points);
+
+		update_cluster_half_distances();
+		update_max_shifts();
+		data_points_moved = assign_in_parallel([&](unsigned int begin, unsigned int end, unsigned int worker)
+		{
+			return assign_range_hamerly(begin, end, worker, initialize_bounds);
+		});
+		break;
+	}
+	case assign_yinyang:
+	{
+		const bool initialize_bounds = !bounds_valid;
+		if (initialize_bounds)
+		{
+			group_clusters_for_yinyang();
+			lower_bounds.resize((size_t)number_of_points * number_of_groups);
+		}
+
+		update_group_shifts();
+		data_points_moved = assign_in_parallel([&](unsigned int begin, unsigned int end, unsigned int worker)
+		{
+			return assign_range_yinyang(begin, end, worker, initialize_bounds);
+		});
+		break;
+	}
+	case assign_kd_tree:
+	{
+		if (!tree_valid)
+			build_kd_tree();
+
+		// The tree is filtered on this thread, starting at the root with 
+		// every cluster as a candidate
+		tree_candidates.resize(number_of_clusters);
+		for (unsigned int c = 0; c < number_of_clusters; c++)
+			tree_candidates[c] = c;
+
+		data_points_moved = assign_kd_node(0, 0, number_of_clusters);
+		break;
+	}
+	case assign_gemm:
+	{
+		update_norms();
+		data_points_moved = assign_in_parallel([&](unsigned int begin, unsigned int end, unsigned int worker)
+		{
+			return assign_range_gemm(begin, end, worker);
+		});
+		break;
+	}
+	default:
+		if (partial_search() && use_variance_order)
+			update_dimension_order();
+		data_points_moved = assign_in_parallel([&](unsigned int begin, unsigned int end, unsigned int worker)
+		{
+			return assign_range_brute_force(begin, end, worker);
+		});
+		break;
+	}
+
+	// Any bounds now account for the latest cluster positions
+	if (method == assign_elkan || method == assign_hamerly || method == assign_yinyang)
+	{
+		cluster_shift.assign(number_of_clusters, 0);
+		bounds_valid = true;
+	}
+
+	// Note which clusters gained or lost points, or all of them when the
+	// moves weren't listed, or when the sums are redone in full after 
+	// incremental ones, which every cluster needs to shed any drift from
+	if (!moves_listed || (incremental_centroids && !incremental) || cluster_changed.size() != number_of_clusters)
+		cluster_changed.assign(number_of_clusters, 1);
+	else
+	{
+		for (size_t m = 0; m < moved_points.size(); m++)
+		{
+			cluster_changed[moved_points[m].second] = 1;
+			cluster_changed[(*assignments)[moved_points[m].first]] = 1;
+		}
+	}
+
+	if (incremental)
+		cluster_sums_valid = moves_listed && update_cluster_sums_from_moves();
+	else
+	{
+		cluster_sums_valid = fuse_cluster_sums;
+		if (fuse_cluster_sums)
+		{
+			reduce_cluster_sums();
+			rounds_since_exact = 0;
+		}
+	}
+
+	incremental_sums_valid = incremental_centroids && cluster_sums_valid;
+	tracking_moves = false;
+	fuse_cluster_sums = true;
+}
+
+/*
+Run assign_range(begin, end, worker) over all the data points, in chunks balanced across
+the worker threads. Each thread counts the points that moved in its own chunks,
+and the counts are added up at the end, so the assignments and the count are the
+same as running assign_range over all the points on one thread.
+While tracking_moves, each thread also notes the assignments of each chunk 
+before it runs, and lists the points that changed, which are gathered into 
+moved_points in order. Listing stops once more points have moved than could
+be taken out of and added to the cluster sums one at a time in less time than
+summing one slice of them in full, leaving moves_listed unset. That doesn't
+depend on the number of threads, so neither do the sums.
+Returns the number of data points that moved.
+*/
+template <typename T, unsigned int N> template <typename F> unsigned int tsClusters<T, N>::assign_in_parallel(F assign_range)
+{
+	// Padded out so each worker's count sits on its own cache line
+	const unsigned int spacing = 64 / sizeof(unsigned int);
+	std::vector<unsigned int> worker_moved((size_t)thread_count() * spacing, 0);
+	std::vector<std::vector<unsigned int>> worker_previous(tracking_moves ? thread_count() : 0);
+	std::vector<std::vector<std::pair<unsigned int, unsigned int>>> worker_moves(tracking_moves ? thread_count() : 0);
+	const size_t move_limit = number_of_points / (2 * (size_t)sum_slice_count());
+	std::atomic<size_t> moves_counted(0);
+
+	parallel_for_chunks(number_of_points, [&](unsigned int begin, unsigned int end, unsigned int worker)
+	{
+		if (!tracking_moves)
+		{
+			worker_moved[(size_t)worker * spacing] += assign_range(begin, end, worker);
+			return;
+		}
+
+		std::vector<unsigned int>& previous = worker_previous[worker];
+		previous.assign(assignments->begin() + begin, assignments->begin() + end);
+		worker_moved[(size_t)worker * spacing] += assign_range(begin, end, worker);
+		if (moves_counted.load() > move_limit)
+			return;
+
+		size_t listed = 0;
+		for (unsigned int i = begin; i < end; i++)
+		{
+			if ((*assignments)[i] != previous[i - begin])
+			{
+				worker_moves[worker].push_back(std::make_pair(i, previous[i - begin]));
+				listed++;
+			}
+		}
+		moves_counted += listed;
+	});
+
+	unsigned int moved = 0;
+	for (unsigned int w = 0; w < thread_count(); w++)
+		moved += worker_moved[(size_t)w * spacing];
+
+	// Which thread ran which chunk varies, so put the moves back in order
+	moves_listed = tracking_moves && moves_counted.load() <= move_limit;
+	for (size_t w = 0; moves_listed && w < worker_moves.size(); w++)
+		moved_points.insert(moved_points.end(), worker_moves[w].begin(), worker_moves[w].end());
+	std::sort(moved_points.begin(), moved_points.end());
+
+	return moved;
+}
+
+/*
+Assign the closest cluster to each data point in [begin, end) by comparing it to
+every cluster. With the partial distance search, each point starts from the
+cluster it had last round, which is usually still the closest, and every other
+distance is given up on once it can't be closer. With the dimensions in 
+variance order, the reordered copies of the points and clusters are compared 
+instead. Returns the number of data points that moved.
+*/
+template <typename T, unsigned int N> unsigned int tsClusters<T, N>::assign_range_brute_force(unsigned int begin, unsigned int end, unsigned int worker)
+{
+	unsigned int moved = 0;
+	const bool ordered = partial_search() && use_variance_order;
+	const T* centers = ordered ? ordered_clusters.data() : local_clusters(worker);
+	const T* centers_transposed = use_transposed_clusters ? local_clusters_transposed(worker) : nullptr;
+
+	T computed_distance = 0; // Accumulator for the (p1-q1)^2 part of the distance computation
+	
+	unsigned int current_cluster_index = 0; // For keeping track of which cluster we're checking
+	unsigned int closest_cluster_index = 0; // For keeping track of which was the closest cluster so far
+	T closest_cluster_distance = std::numeric_limits<T>::max();
+
+	// Scratch space for the distances from one data point to every cluster
+	std::vector<T> cluster_distances(use_transposed_clusters ? number_of_clusters : 0);
+
+	// For every data point in the range...
+	for (unsigned int i = begin; i < end; i++)
+	{
+		const T* p = ordered ? &ordered_points[(size_t)i * row_stride] : point(i);
+		closest_cluster_distance = std::numeric_limits<T>::max();
+
+		// With the transposed clusters and a SIMD kernel, compare the point to
+		// a vector's worth of clusters at a time, keeping the nearest per lane
+		if (use_transposed_clusters && nearest_kernel)
+		{
+			closest_cluster_index = nearest_kernel(p, centers_transposed, number_of_clusters, transposed_stride, dimensions(), closest_cluster_distance);
+			moved += finish_assignment(i, closest_cluster_index, closest_cluster_distance);
+			continue;
+		}
+
+		// With the partial distance search, start from last round's cluster and
+		// give up on each of the others once it can't be closer. One with a
+		// lower index than the closest so far is followed through to an equal
+		// distance, to keep ties going to the lowest index
+		if (partial_search())
+		{
+			closest_cluster_index = (*assignments)[i] < number_of_clusters ? (*assignments)[i] : 0;
+			const unsigned int first = closest_cluster_index;
+			closest_cluster_distance = compute_partial_squared_distance(p, &centers[(size_t)first * row_stride], closest_cluster_distance);
+
+			for (current_cluster_index = 0; current_cluster_index < number_of_clusters; current_cluster_index++)
+			{
+				if (current_cluster_index == first)
+					continue;
+
+				const T limit = (current_cluster_index < closest_cluster_index) ? next_above(closest_cluster_distance) : closest_cluster_distance;
+				computed_distance = compute_partial_squared_distance(p, &centers[(size_t)current_cluster_index * row_stride], limit);
+				if (is_closer(computed_distance, current_cluster_index, closest_cluster_distance, closest_cluster_index))
+				{
+					closest_cluster_distance = computed_distance;
+					closest_cluster_index = current_cluster_index;
+				}
+			}
+
+			moved += finish_assignment(i, closest_cluster_index, closest_cluster_distance);
+			continue;
+		}
+
+		// Otherwise with the transposed clusters, compute the distance to every
+		// cluster in one sweep over the dimensions, then pick the closest below
+		if (use_transposed_clusters)
+		{
+			T* cd = cluster_distances.data();
+			memset(cd, 0, sizeof(T) * number_of_clusters);
+
+			for (unsigned int j = 0; j < dimensions(); j++)
+			{
+				const T pj = p[j];
+				const T* ct = &centers_transposed[(size_t)j * transposed_stride];
+				for (unsigned int c = 0; c < number_of_clusters; c++)
+					cd[c] += (pj - ct[c]) * (pj - ct[c]);
+			}
+		}
+
+		// ...compare to every cluster point...
+		for (current_cluster_index = 0; current_cluster_index < number_of_clusters; current_cluster_index++)
+		{
+			computed_distance = 0;
+
+			/*****************
+			Basically we're doing an N-dimensional distance comparison, to find
+			the index of the cluster that is the closest to the data point.
+			Using a distance formula like this:
+			distance(p,q) = sqrt((p1-q1)^2 + (p2-q2)^2 + ... + (pN-qN)^2)
+			Except we don't need to bother with the expensive sqrt operation.
+			So in this inner loop we're just accumulating the various (p1-q1)^2
+			result for each cluster and data point T value.
+			NOTE: The data and cluster rows share the same stride because
+			of internal consistency checks for stride.
+			******************/
+			if (use_transposed_clusters)
+				computed_distance = cluster_distances[current_cluster_index];
+			else
+				computed_distance = compute_squared_distance(p, &centers[(size_t)current_cluster_index * row_stride]);
+
+			if (computed_distance < closest_cluster_distance)
+			{
+				closest_cluster_distance = computed_distance;
+				closest_cluster_index = current_cluster_index;
+			}
+
+		} // end for every cluster
+
+		// Assign the cluster index to this data point, counting it if it moved
+		moved += finish_assignment(i, closest_cluster_index, closest_cluster_distance);
+		
+	} // end for every data point
+
+	return moved;
+}
+
+/*
+Assign the closest cluster to each data point in [begin, end) using Elkan's
+algorithm (Elkan, "Using the Triangle Inequality to Accelerate k-Means", 2003).
+Each point keeps an upper bound on the distance to its assigned cluster, and a 
+lower bound on the distance to every other cluster. After the clusters move, the
+bounds are loosened by how far each cluster moved, and a cluster is only compared
+to a point when the bounds can't rule it out, either directly or because the
+clusters are too far apart for it to be closer than the assigned one.
+The result is the same as brute force, including ties going to the lowest index.
+With initialize_bounds set, every distance is computed to set up the bounds.
+Returns the number of data points that moved.
+*/
+template <typename T, unsigned int N> unsigned int tsClusters<T, N>::assign_range_elkan(unsigned int begin, unsigned int end, unsigned int worker, bool initialize_bounds)
+{
+	unsigned int moved = 0;
+	const T* centers = local_clusters(worker);
+	const unsigned int k = number_of_clusters;
+
+	for (unsigned int i = begin; i < end; i++)
+	{
+		const T* p = point(i);
+		bound_type* lb = &lower_bounds[(size_t)i * k];
+
+		if (initialize_bounds)
+		{
+			unsigned int best = 0;
+			T best_dsq = std::numeric_limits<T>::max();
+			for (unsigned int c = 0; c < k; c++)
+			{
+				const T dsq = compute_squared_distance(p, &centers[(size_t)c * row_stride]);
+				lb[c] = round_down(bound_from_squared(dsq));
+				if (dsq < best_dsq)
+				{
+					best_dsq = dsq;
+					best = c;
+				}
+			}
+
+			moved += finish_assignment(i, best, best_dsq);
+			continue;
+		}
+
+		// Loosen the bounds by how far the clusters moved, for those that did
+		unsigned int best = (*assignments)[i];
+		bound_type upper = round_up(bound_from_squared((*distances)[i]) + cluster_shift[best]);
+		for (size_t m = 0; m < moved_clusters.size(); m++)
+		{
+			const unsigned int c = moved_clusters[m];
+			lb[c] = round_down(std::max<bound_type>(lb[c] - cluster_shift[c], 0));
+		}
+
+		// Closer to its cluster than half way to any other cluster, so it stays
+		if (upper < cluster_half_nearest[best])
+		{
+			moved += finish_assignment(i, best, squared_from_bound(upper));
+			continue;
+		}
+
+		bool tight = false;
+		T best_dsq = 0;
+
+		for (unsigned int c = 0; c < k; c++)
+		{
+			if (c == best)
+				continue;
+
+			if (upper < lb[c] || upper < cluster_half_distances[(size_t)best * k + c])
+				continue;
+
+			// The bounds can't rule this cluster out, so first make the upper
+			// bound exact and try again
+			if (!tight)
+			{
+				best_dsq = compute_squared_distance(p, &centers[(size_t)best * row_stride]);
+				upper = round_up(bound_from_squared(best_dsq));
+				lb[best] = round_down(bound_from_squared(best_dsq));
+				tight = true;
+
+				if (upper < lb[c] || upper < cluster_half_distances[(size_t)best * k + c])
+					continue;
+			}
+
+			const T dsq = compute_squared_distance(p, &centers[(size_t)c * row_stride]);
+			lb[c] = round_down(bound_from_squared(dsq));
+
+			if (is_closer(dsq, c, best_dsq, best))
+			{
+				best = c;
+				best_dsq = dsq;
+				upper = round_up(bound_from_squared(dsq));
+			}
+		}
+
+		moved += finish_assignment(i, best, tight ? best_dsq : squared_from_bound(upper));
+	}
+
+	return moved;
+}
+
+/*
+Assign the closest cluster to each data point in [begin, end) using Hamerly's
+algorithm (Hamerly, "Making k-means Even Faster", 2010).
+Each point keeps an upper bound on the distance to its assigned cluster, kept
+squared in distances, and a single lower bound on the distance to the second
+closest cluster. When the upper bound is below the lower bound, or below half
+the distance from the assigned cluster to its nearest other cluster, the point
+can't move and no clusters are scanned for it at all. Otherwise the upper
+bound is made exact and, if that still isn't enough, every cluster is scanned.
+This needs O(n) extra memory rather than Elkan's O(n*k), which suits large
+data sets with few clusters.
+The result is the same as brute force, including ties going to the lowest index.
+With initialize_bounds set, every distance is computed to set up the bounds.
+Returns the number of data points that moved.
+*/
+template <typename T, unsigned int N> unsigned int tsClusters<T, N>::assign_range_hamerly(unsigned int begin, unsigned int end, unsigned int worker, bool initialize_bounds)
+{
+	unsigned int moved = 0;
+	const T* centers = local_clusters(worker);
+
+	for (unsigned int i = begin; i < end; i++)
+	{
+		const T* p = point(i);
+		unsigned int best = (*assignments)[i];
+
+		if (!initialize_bounds)
+		{
+			// Loosen the bounds by how far the clusters moved, where the lower
+			// bound moves by the most any other cluster moved
+			bound_type upper = round_up(bound_from_squared((*distances)[i]) + cluster_shift[best]);
+			const bound_type other_shift = (best == max_shift_index) ? second_max_shift : max_shift;
+			lower_bounds[i] = round_down(std::max<bound_type>(lower_bounds[i] - other_shift, 0));
+
+			const bound_type limit = std::max(lower_bounds[i], cluster_half_nearest[best]);
+			if (upper < limit)
+			{
+				moved += finish_assignment(i, best, squared_from_bound(upper));
+				continue;
+			}
+
+			// Make the upper bound exact and try again
+			const T best_dsq = compute_squared_distance(p, &centers[(size_t)best * row_stride]);
+			upper = round_up(bound_from_squared(best_dsq));
+			if (upper < limit)
+			{
+				moved += finish_assignment(i, best, best_dsq);
+				continue;
+			}
+		}
+
+		// Scan every cluster for the closest and second closest
+		T best_dsq = std::numeric_limits<T>::max();
+		T second_dsq = std::numeric_limits<T>::max();
+		for (unsigned int c = 0; c < number_of_clusters; c++)
+		{
+			const T dsq = compute_squared_distance(p, &centers[(size_t)c * row_stride]);
+			if (dsq < best_dsq)
+			{
+				second_dsq = best_dsq;
+				best_dsq = dsq;
+				best = c;
+			}
+			else if (dsq < second_dsq)
+				second_dsq = dsq;
+		}
+
+		lower_bounds[i] = round_down(bound_from_squared(second_dsq));
+		moved += finish_assignment(i, best, best_dsq);
+	}
+
+	return moved;
+}
+
+/*
+Assign the closest cluster to each data point in [begin, end) using the Yinyang
+algorithm (Ding et al., "Yinyang K-Means: A Drop-In Replacement of the Classic 
+K-Means with Consistent Speedup", 2015).
+The clusters are split into groups, and each point keeps an upper bound on the
+distance to its assigned cluster, kept squared in distances, plus one lower
+bound per group on the distance to the clusters in that group (other than the
+assigned one). A point is skipped outright when its upper bound is below all 
+of its group bounds (the global filter), otherwise each group whose bound is 
+above the best distance found so far is skipped (the group filter), and within
+the remaining groups a cluster is skipped when the group bound less that
+cluster's own shift still rules it out (the local filter).
+This needs O(n*k/10) memory, and filters most of the work for large k.
+The result is the same as brute force, including ties going to the lowest index.
+With initialize_bounds set, every distance is computed to set up the bounds.
+Returns the number of data points that moved.
+*/
+template <typename T, unsigned int N> unsigned int tsClusters<T, N>::assign_range_yinyang(unsigned int begin, unsigned int end, unsigned int worker, bool initialize_bounds)
+{
+	unsigned int moved = 0;
+	const T* centers = local_clusters(worker);
+	const unsigned int t = number_of_groups;
+
+	// Per group, the smallest and second smallest distance (or lower bound)
+	// seen among its clusters this round, and the cluster the smallest was for
+	std::vector<bound_type> smallest(t);
+	std::vector<bound_type> second_smallest(t);
+	std::vector<unsigned int> smallest_index(t);
+	std::vector<char> examined(t);
+	std::vector<bound_type> old_lb(t);
+
+	for (unsigned int i = begin; i < end; i++)
+	{
+		const T* p = point(i);
+		bound_type* lb = &lower_bounds[(size_t)i * t];
+		const unsigned int assigned = (*assignments)[i];
+		T assigned_dsq = 0;
+
+		if (initialize_bounds)
+		{
+			// Every group gets examined, with no cluster left out
+			for (unsigned int g = 0; g < t; g++)
+				old_lb[g] = 0;
+		}
+		else
+		{
+			// Loosen the bounds by how far the clusters moved
+			bound_type upper = round_up(bound_from_squared((*distances)[i]) + cluster_shift[assigned]);
+			bound_type global_lb = std::numeric_limits<bound_type>::max();
+			for (unsigned int g = 0; g < t; g++)
+			{
+				old_lb[g] = lb[g];
+				lb[g] = round_down(std::max<bound_type>(lb[g] - group_shift[g], 0));
+				global_lb = std::min(global_lb, lb[g]);
+			}
+
+			// Global filter
+			if (upper < global_lb)
+			{
+				moved += finish_assignment(i, assigned, squared_from_bound(upper));
+				continue;
+			}
+
+			// Make the upper bound exact and try again
+			assigned_dsq = compute_squared_distance(p, &centers[(size_t)assigned * row_stride]);
+			upper = round_up(bound_from_squared(assigned_dsq));
+			if (upper < global_lb)
+			{
+				moved += finish_assignment(i, assigned, assigned_dsq);
+				continue;
+			}
+		}
+
+		unsigned int best = initialize_bounds ? number_of_clusters : assigned;
+		T best_dsq = initialize_bounds ? std::numeric_limits<T>::max() : assigned_dsq;
+		bound_type best_upper = initialize_bounds ? std::numeric_limits<bound_type>::max() : round_up(bound_from_squared(best_dsq));
+
+		for (unsigned int g = 0; g < t; g++)
+		{
+			smallest[g] = std::numeric_limits<bound_type>::max();
+			second_smallest[g] = std::numeric_limits<bound_type>::max();
+			smallest_index[g] = number_of_clusters;
+
+			// Group filter
+			examined[g] = initialize_bounds || !(best_upper < lb[g]);
+			if (!examined[g])
+				continue;
+
+			for (unsigned int gi = group_begin[g]; gi < group_begin[g + 1]; gi++)
+			{
+				const unsigned int c = group_clusters[gi];
+				if (!initialize_bounds && c == assigned)
+					continue;
+
+				// Local filter, this cluster's own bound is the group bound from 
+				// before it was loosened, less how far this cluster moved
+				bound_type value = initialize_bounds ? 0 : round_down(old_lb[g] - cluster_shift[c]);
+				if (initialize_bounds || !(best_upper < value))
+				{
+					const T dsq = compute_squared_distance(p, &centers[(size_t)c * row_stride]);
+					value = round_down(bound_from_squared(dsq));
+
+					if (is_closer(dsq, c, best_dsq, best))
+					{
+						best = c;
+						best_dsq = dsq;
+						best_upper = round_up(bound_from_squared(dsq));
+					}
+				}
+
+				if (value < smallest[g])
+				{
+					second_smallest[g] = smallest[g];
+					smallest[g] = value;
+					smallest_index[g] = c;
+				}
+				else if (value < second_smallest[g])
+					second_smallest[g] = value;
+			}
+		}
+
+		// The group bounds cover every cluster in the group other than the
+		// one the point ends up assigned to
+		for (unsigned int g = 0; g < t; g++)
+		{
+			if (examined[g])
+				lb[g] = (smallest_index[g] == best) ? second_smallest[g] : smallest[g];
+
+			if (!initialize_bounds && best != assigned && cluster_group[assigned] == g)
+				lb[g] = std::min(lb[g], round_down(bound_from_squared(assigned_dsq)));
+		}
+
+		moved += finish_assignment(i, best, best_dsq);
+	}
+
+	return moved;
+}
+
+/*
+Split the clusters into about one group per ten clusters for Yinyang, by 
+clustering the clusters themselves with a few rounds of k-means
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::group_clusters_for_yinyang()
+{
+	const unsigned int k = number_of_clusters;
+	number_of_groups = std::max(1u, k / 10);
+
+	// Start each group center off at an evenly spaced cluster
+	std::vector<T> group_centers((size_t)number_of_groups * row_stride);
+	for (unsigned int g = 0; g < number_of_groups; g++)
+		memcpy(&group_centers[(size_t)g * row_stride], cluster((unsigned int)((size_t)g * k / number_of_groups)), sizeof(T) * row_stride);
+
+	cluster_group.assign(k, 0);
+	std::vector<T> sums((size_t)number_of_groups * stride);
+	std::vector<unsigned int> counts(number_of_groups);
+
+	for (unsigned int round = 0; round < 5; round++)
+	{
+		std::fill(sums.begin(), sums.end(), (T)0);
+		std::fill(counts.begin(), counts.end(), 0u);
+
+		for (unsigned int c = 0; c < k; c++)
+		{
+			T best_dsq = std::numeric_limits<T>::max();
+			for (unsigned int g = 0; g < number_of_groups; g++)
+			{
+				const T dsq = compute_squared_distance(cluster(c), &group_centers[(size_t)g * row_stride]);
+				if (dsq < best_dsq)
+				{
+					best_dsq = dsq;
+					cluster_group[c] = g;
+				}
+			}
+
+			const T* cp = cluster(c);
+			T* sum = &sums[(size_t)cluster_group[c] * stride];
+			for (unsigned int j = 0; j < dimensions(); j++)
+				sum[j] += cp[j];
+			counts[cluster_group[c]]++;
+		}
+
+		for (unsigned int g = 0; g < number_of_groups; g++)
+		{
+			if (!counts[g])
+				continue;
+			for (unsigned int j = 0; j < dimensions(); j++)
+				group_centers[(size_t)g * row_stride + j] = sums[(size_t)g * stride + j] / counts[g];
+		}
+	}
+
+	// Lay the groups out back to back, each in cluster index order
+	group_begin.assign(number_of_groups + 1, 0);
+	for (unsigned int c = 0; c < k; c++)
+		group_begin[cluster_group[c] + 1]++;
+	for (unsigned int g = 0; g < number_of_groups; g++)
+		group_begin[g + 1] += group_begin[g];
+
+	group_clusters.resize(k);
+	std::vector<unsigned int> next(group_begin.begin(), group_begin.end() - 1);
+	for (unsigned int c = 0; c < k; c++)
+		group_clusters[next[cluster_group[c]]++] = c;
+}
+
+/*
+Assign the closest cluster to every data point under a node of the k-d tree using
+the filtering algorithm (Kanungo et al., "An Efficient k-Means Clustering 
+Algorithm: Analysis and Implementation", 2002).
+The candidate clusters for the node are tree_candidates[candidates_begin] up to
+tree_candidates[candidates_end], in index order. Of these, the one closest to 
+the middle of the node's box is kept, along with any other that is closer than 
+it to some corner of the box. When that leaves a single candidate, every point
+under the node belongs to it, and the node's cached sum is added to the cluster 
+in one go. Its points are only relabelled, without working out their distances,
+so each one's distance is left as an upper bound of max(). Otherwise the 
+remaining candidates are passed on to the children, or at a leaf compared to 
+each point in turn.
+Candidates are only dropped when they are further by more than rounding error, 
+so the assignments are the same as brute force, including ties going to the 
+lowest index. Returns the number of data points that moved.
+*/
+template <typename T, unsigned int N> unsigned int tsClusters<T, N>::assign_kd_node(unsigned int node, size_t candidates_begin, size_t candidates_end)
+{
+	const kd_node& n = tree_nodes[node];
+	const T* lo = &tree_bounds[(size_t)node * 2 * stride];
+	const T* hi = lo + stride;
+
+	// Find the candidate closest to the middle of the box
+	unsigned int closest = tree_candidates[candidates_begin];
+	bound_type closest_dsq = std::numeric_limits<bound_type>::max();
+	for (size_t ci = candidates_begin; ci < candidates_end; ci++)
+	{
+		const T* cp = cluster(tree_candidates[ci]);
+		bound_type dsq = 0;
+		for (unsigned int j = 0; j < dimensions(); j++)
+		{
+			const bound_type diff = ((bound_type)lo[j] + hi[j]) / 2 - cp[j];
+			dsq += diff * diff;
+		}
+
+		if (dsq < closest_dsq)
+		{
+			closest_dsq = dsq;
+			closest = tree_candidates[ci];
+		}
+	}
+
+	// Keep the candidates that could still be closest for some point in the box
+	const size_t filtered_begin = tree_candidates.size();
+	const bound_type tolerance = 4 * (dimensions() + 4) * std::numeric_limits<bound_type>::epsilon();
+	const T* zs = cluster(closest);
+
+	for (size_t ci = candidates_begin; ci < candidates_end; ci++)
+	{
+		const unsigned int c = tree_candidates[ci];
+		if (c != closest)
+		{
+			// The corner of the box furthest in the direction from the closest
+			// candidate to this one is where this one does best against it
+			const T* z = cluster(c);
+			bound_type corner_z = 0, corner_zs = 0, farthest = 0;
+			for (unsigned int j = 0; j < dimensions(); j++)
+			{
+				const bound_type v = (z[j] > zs[j]) ? hi[j] : lo[j];
+				corner_z += (v - z[j]) * (v - z[j]);
+				corner_zs += (v - zs[j]) * (v - zs[j]);
+
+				const bound_type far_lo = std::max(std::abs((bound_type)lo[j] - z[j]), std::abs((bound_type)lo[j] - zs[j]));
+				const bound_type far_hi = std::max(std::abs((bound_type)hi[j] - z[j]), std::abs((bound_type)hi[j] - zs[j]));
+				farthest += std::max(far_lo, far_hi) * std::max(far_lo, far_hi);
+			}
+
+			if (corner_z - corner_zs > tolerance * 2 * farthest)
+				continue;
+		}
+
+		tree_candidates.push_back(c);
+	}
+
+	const size_t filtered_end = tree_candidates.size();
+	unsigned int moved = 0;
+
+	if (filtered_end - filtered_begin == 1)
+	{
+		// Every point under this node belongs to the one candidate left
+		for (unsigned int x = n.begin; x < n.end; x++)
+			moved += record_assignment(tree_order[x], closest, std::numeric_limits<T>::max());
+
+		const T* node_sum = &tree_sums[(size_t)node * stride];
+		T* sum = cluster_sum(closest);
+		for (unsigned int j = 0; j < dimensions(); j++)
+			sum[j] += node_sum[j];
+		cluster_count(closest) += n.end - n.begin;
+	}
+	else if (!n.left)
+	{
+		// At a leaf, compare each point to the remaining candidates
+		for (unsigned int x = n.begin; x < n.end; x++)
+		{
+			const unsigned int i = tree_order[x];
+			const T* p = point(i);
+			unsigned int best = 0;
+			T best_dsq = std::numeric_limits<T>::max();
+
+			for (size_t ci = filtered_begin; ci < filtered_end; ci++)
+			{
+				const T dsq = compute_squared_distance(p, cluster(tree_candidates[ci]));
+				if (dsq < best_dsq)
+				{
+					best_dsq = dsq;
+					best = tree_candidates[ci];
+				}
+			}
+
+			moved += finish_assignment(i, best, best_dsq);
+		}
+	}
+	else
+	{
+		moved += assign_kd_node(n.left, filtered_begin, filtered_end);
+		moved += assign_kd_node(n.right, filtered_begin, filtered_end);
+	}
+
+	tree_candidates.resize(filtered_begin);
+	return moved;
+}
+
+/*
+Bring the squared norms up to date for the matrix product method: the data
+points' once per data set, split across the worker threads, and the clusters'
+every round. Both use the same dot product kernel as the cross terms.
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::update_norms()
+{
+	const auto dot4 = dot4_kernel;
+
+	if (!point_norms_valid)
+	{
+		point_norms.resize(number_of_points);
+		parallel_for(number_of_points, [&](unsigned int begin, unsigned int end, unsigned int)
+		{
+			for (unsigned int i = begin; i < end; i++)
+			{
+				T norm[4] = { 0, 0, 0, 0 };
+				dot4(point(i), point(i), 0, dimensions(), norm);
+				point_norms[i] = norm[0];
+			}
+		});
+		point_norms_valid = true;
+	}
+
+	cluster_norms.resize(number_of_clusters);
+	for (unsigned int c = 0; c < number_of_clusters; c++)
+	{
+		T norm[4] = { 0, 0, 0, 0 };
+		dot4(cluster(c), cluster(c), 0, dimensions(), norm);
+		cluster_norms[c] = norm[0];
+	}
+}
+
+/*
+Assign the closest cluster to each data point in [begin, end) using the
+expansion ||x - c||^2 = ||x||^2 - 2 x.c + ||c||^2, with the norms from
+update_norms and the cross terms computed as a matrix product of the points
+and clusters. The product is blocked into tiles of points by clusters by
+dimensions, small enough that a tile of points and a tile of clusters both
+stay in cache while each point is multiplied by four clusters at a time.
+This suits high dimensional data, where comparing one point to one cluster
+at a time is held up by reading the clusters from memory over and over.
+The expansion loses precision to cancellation, by at most a small multiple of
+the dimensions times epsilon times ||x||^2 + ||c||^2. So each point then 
+compares the clusters the expansion can't rule out within that margin by 
+their actual distance, usually only one or two, and the assignments and 
+distances recorded are the same as brute force.
+Returns the number of data points that moved.
+*/
+template <typename T, unsigned int N> unsigned int tsClusters<T, N>::assign_range_gemm(unsigned int begin, unsigned int end, unsigned int worker)
+{
+	unsigned int moved = 0;
+	const T* centers = local_clusters(worker);
+	const auto dot4 = dot4_kernel;
+	const unsigned int k = number_of_clusters;
+	const size_t cluster_stride = row_stride;
+	const unsigned int dimension_tile = gemm_dimension_tile; // std::min takes a reference
+
+	// The error in an expanded squared distance, and in the one brute force
+	// would compute, is within slack times ||x||^2 + ||c||^2
+	const bound_type slack = (4 * (bound_type)dimensions() + 32) * (bound_type)std::numeric_limits<T>::epsilon();
+
+	// The cross terms for one tile of points by one tile of clusters, and the
+	// expanded squared distances from each point of the tile to every cluster
+	std::vector<T> dots((size_t)gemm_point_tile * gemm_cluster_tile);
+	std::vector<T> expanded((size_t)gemm_point_tile * k);
+
+	for (unsigned int point_begin = begin; point_begin < end; point_begin += gemm_point_tile)
+	{
+		const unsigned int point_end = std::min(end, point_begin + gemm_point_tile);
+
+		for (unsigned int cluster_begin = 0; cluster_begin < k; cluster_begin += gemm_cluster_tile)
+		{
+			const unsigned int cluster_end = std::min(k, cluster_begin + gemm_cluster_tile);
+			std::fill(dots.begin(), dots.end(), (T)0);
+
+			for (unsigned int j = 0; j < dimensions(); j += dimension_tile)
+			{
+				const unsigned int length = std::min(dimensions() - j, dimension_tile);
+
+				for (unsigned int i = point_begin; i < point_end; i++)
+				{
+					const T* x = point(i) + j;
+					T* row = &dots[(size_t)(i - point_begin) * gemm_cluster_tile];
+					unsigned int c = cluster_begin;
+
+					for (; c + 4 <= cluster_end; c += 4)
+						dot4(x, centers + c * cluster_stride + j, cluster_stride, length, &row[c - cluster_begin]);
+
+					// Any last clusters short of four go through one at a time
+					for (; c < cluster_end; c++)
+					{
+						T single[4] = { 0, 0, 0, 0 };
+						dot4(x, centers + c * cluster_stride + j, 0, length, single);
+						row[c - cluster_begin] += single[0];
+					}
+				}
+			}
+
+			for (unsigned int i = point_begin; i < point_end; i++)
+			{
+				const T* row = &dots[(size_t)(i - point_begin) * gemm_cluster_tile];
+				T* e = &expanded[(size_t)(i - point_begin) * k];
+				for (unsigned int c = cluster_begin; c < cluster_end; c++)
+					e[c] = point_norms[i] - 2 * row[c - cluster_begin] + cluster_norms[c];
+			}
+		}
+
+		for (unsigned int i = point_begin; i < point_end; i++)
+		{
+			const T* e = &expanded[(size_t)(i - point_begin) * k];
+			const bound_type x_norm = point_norms[i];
+
+			// The closest cluster by brute force is no further than the least
+			// upper bound, so only clusters whose lower bound is within it 
+			// are compared by their actual distance. They're taken in order
+			// and only replaced when strictly closer, so ties go to the lowest
+			bound_type least_upper = std::numeric_limits<bound_type>::max();
+			for (unsigned int c = 0; c < k; c++)
+				least_upper = std::min(least_upper, (bound_type)e[c] + slack * (x_norm + cluster_norms[c]));
+
+			unsigned int best = k;
+			T best_dsq = 0;
+			for (unsigned int c = 0; c < k; c++)
+			{
+				if ((bound_type)e[c] - slack * (x_norm + cluster_norms[c]) > least_upper)
+					continue;
+
+				const T dsq = compute_squared_distance(point(i), centers + c * cluster_stride);
+				if (best == k || dsq < best_dsq)
+				{
+					best_dsq = dsq;
+					best = c;
+				}
+			}
+
+			moved += finish_assignment(i, best, best_dsq);
+		}
+	}
+
+	return moved;
+}
+
+/*
+Build the k-d tree over the current data set
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::build_kd_tree()
+{
+	tree_nodes.clear();
+	tree_bounds.clear();
+	tree_sums.clear();
+
+	tree_order.resize(number_of_points);
+	for (unsigned int i = 0; i < number_of_points; i++)
+		tree_order[i] = i;
+
+	if (number_of_points)
+		build_kd_node(0, number_of_points);
+
+	tree_valid = true;
+}
+
+/*
+Build the k-d tree node covering tree_order[begin] up to tree_order[end], and 
+everything below it. Returns the index of the node.
+*/
+template <typename T, unsigned int N> unsigned int tsClusters<T, N>::build_kd_node(unsigned int begin, unsigned int end)
+{
+	const unsigned int leaf_size = 16;
+
+	const unsigned int node = (unsigned int)tree_nodes.size();
+	kd_node n = { begin, end, 0, 0 };
+	tree_nodes.push_back(n);
+	tree_bounds.resize(tree_bounds.size() + 2 * stride);
+	tree_sums.resize(tree_sums.size() + stride, 0);
+
+	// Find the box around the points, and their sum at a leaf
+	const bool leaf = (end - begin <= leaf_size);
+	T* lo = &tree_bounds[(size_t)node * 2 * stride];
+	T* hi = lo + stride;
+	T* sum = &tree_sums[(size_t)node * stride];
+	for (unsigned int j = 0; j < stride; j++)
+	{
+		lo[j] = std::numeric_limits<T>::max();
+		hi[j] = std::numeric_limits<T>::lowest();
+	}
+	for (unsigned int x = begin; x < end; x++)
+	{
+		const T* p = point(tree_order[x]);
+		for (unsigned int j = 0; j < dimensions(); j++)
+		{
+			lo[j] = std::min(lo[j], p[j]);
+			hi[j] = std::max(hi[j], p[j]);
+			if (leaf)
+				sum[j] += p[j];
+		}
+	}
+
+	if (!leaf)
+	{
+		// Split the box at the median of its widest dimension
+		unsigned int split = 0;
+		for (unsigned int j = 1; j < dimensions(); j++)
+			if (hi[j] - lo[j] > hi[split] - lo[split])
+				split = j;
+
+		const unsigned int middle = begin + (end - begin) / 2;
+		std::nth_element(tree_order.begin() + begin, tree_order.begin() + middle, tree_order.begin() + end,
+			[this, split](unsigned int a, unsigned int b) { return point(a)[split] < point(b)[split]; });
+
+		// The children grow the node arrays, so index them afresh after
+		const unsigned int left = build_kd_node(begin, middle);
+		const unsigned int right = build_kd_node(middle, end);
+		tree_nodes[node].left = left;
+		tree_nodes[node].right = right;
+
+		for (unsigned int j = 0; j < stride; j++)
+			tree_sums[(size_t)node * stride + j] = tree_sums[(size_t)left * stride + j] + tree_sums[(size_t)right * stride + j];
+	}
+
+	return node;
+}
+
+/*
+Find the most any cluster in each group has moved
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::update_group_shifts()
+{
+	group_shift.assign(number_of_groups, 0);
+
+	for (unsigned int c = 0; c < cluster_shift.size(); c++)
+		group_shift[cluster_group[c]] = std::max(group_shift[cluster_group[c]], cluster_shift[c]);
+}
+
+/*
+Find the largest and second largest cluster shifts
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::update_max_shifts()
+{
+	max_shift = 0;
+	second_max_shift = 0;
+	max_shift_index = 0;
+
+	for (unsigned int c = 0; c < cluster_shift.size(); c++)
+	{
+		if (cluster_shift[c] > max_shift)
+		{
+			second_max_shift = max_shift;
+			max_shift = cluster_shift[c];
+			max_shift_index = c;
+		}
+		else if (cluster_shift[c] > second_max_shift)
+			second_max_shift = cluster_shift[c];
+	}
+}
+
+/*
+Compute half the distance between every pair of clusters, and half the distance 
+from each cluster to its nearest other cluster. While the bounds are valid,
+the clusters have only moved by compute_centroids since this was last done, 
+so only the pairs with one of the moved_clusters in them are recomputed.
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::update_cluster_half_distances()
+{
+	const unsigned int k = number_of_clusters;
+	const bool all_pairs = !bounds_valid || cluster_half_distances.size() != (size_t)k * k;
+
+	cluster_half_distances.resize((size_t)k * k);
+	cluster_half_nearest.assign(k, std::numeric_limits<bound_type>::max());
+
+	std::vector<unsigned char> moved(k, all_pairs ? 1 : 0);
+	for (size_t m = 0; m < moved_clusters.size(); m++)
+		moved[moved_clusters[m]] = 1;
+
+	for (unsigned int a = 0; a < k; a++)
+	{
+		cluster_half_distances[(size_t)a * k + a] = 0;
+
+		for (unsigned int b = a + 1; b < k; b++)
+		{
+			if (moved[a] || moved[b])
+			{
+				const bound_type half = round_down(bound_from_squared(compute_squared_distance(cluster(a), cluster(b))) / 2);
+				cluster_half_distances[(size_t)a * k + b] = half;
+				cluster_half_distances[(size_t)b * k + a] = half;
+			}
+
+			const bound_type half = cluster_half_distances[(size_t)a * k + b];
+			cluster_half_nearest[a] = std::min(cluster_half_nearest[a], half);
+			cluster_half_nearest[b] = std::min(cluster_half_nearest[b], half);
+		}
+	}
+}
+
+/*
+Set the algorithm assign_clusters uses to find the closest cluster to each
+data point. All of them find the same closest clusters as brute force, ties
+included; the accelerated ones keep bounds from round to round to skip most
+of the distance computations, and the matrix product method checks its 
+closest candidates by their actual distance. The k-d tree adds up whole 
+cells of points at once, so its clusters can differ in the last bits. It also
+walks the tree on the calling thread alone, however many threads are set, so
+suits low dimensional data that it can prune well enough to make up for that.
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::set_assignment_method(assignment_method input_method)
+{
+	method = input_method;
+	bounds_valid = false;
+
+	// Release the bounds kept by any previous method
+	lower_bounds.clear();
+}
+
+/* 
+Given a set of data points with clusters assigned, compute new cluster
+positions as the centroid of all the points assigned to that cluster.
+This uses the sums accumulated by the last assign_clusters, or if the 
+assignments have not been made since the last call, a single pass over the
+data to build them. If a cluster has no points assigned, it stays where it is.
+Clusters that neither gained nor lost points since the last call are the mean
+of the same points already, so are left as they are, and don't move any 
+bounds. Late in training that's most of them.
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::compute_centroids()
+{
+	if (!stride || !number_of_clusters)
+		return;
+
+	if (clusters->size() < (size_t)number_of_clusters * row_stride)
+		return;
+
+	if (!cluster_sums_valid)
+		accumulate_cluster_sums();
+
+	const bool skip_unchanged = centroids_current && cluster_changed.size() == number_of_clusters;
+	const bool transposed_current = skip_unchanged && use_transposed_clusters && 
+		clusters_transposed.size() == (size_t)stride * transposed_stride && transposed_stride >= number_of_clusters;
+		
+	// For each cluster by index, compute the mean of its sums and store it
+	// as the new set of T values in the cluster
+	for (unsigned int i = 0; i < number_of_clusters; i++)
+	{
+		const unsigned int data_point_counter = cluster_count(i);
+		if (!data_point_counter || (skip_unchanged && !cluster_changed[i]))
+			continue;
+
+		const T* accum = cluster_sum(i);
+		T* cp = cluster(i);
+		T shift_squared = 0;
+		for (unsigned int j = 0; j < dimensions(); j++)
+		{
+			const T mean = accum[j] / data_point_counter;
+			shift_squared += (mean - cp[j]) * (mean - cp[j]);
+			cp[j] = mean;
+		}
+
+		// Keep track of how far the cluster moved for any bounds
+		if (bounds_valid)
+			cluster_shift[i] = round_up(cluster_shift[i] + bound_from_squared(shift_squared));
+
+		if (transposed_current)
+		{
+			for (unsigned int j = 0; j < stride; j++)
+				clusters_transposed[(size_t)j * transposed_stride + i] = cp[j];
+		}
+	}
+
+	// The sums now describe the old positions, so don't reuse them, other
+	// than as the starting point for incremental centroids
+	cluster_sums_valid = false;
+	cluster_changed.assign(number_of_clusters, 0);
+	centroids_current = true;
+
+	if (use_transposed_clusters && !transposed_current)
+		transpose_clusters();
+}
+
+/*
+Zero the per-cluster running sums and counts, with a block for each of up to
+the given number of slices of the data points
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::reset_cluster_sums(unsigned int slices)
+{
+	const size_t line = 64; // Cache line size in bytes
+	sum_block_points = std::max(1u, (number_of_points + slices - 1) / std::max(1u, slices));
+	sum_blocks = std::max(1u, (number_of_points + sum_block_points - 1) / sum_block_points);
+	sum_row_stride = (unsigned int)(((stride * sizeof(T) + line - 1) / line) * line / sizeof(T));
+	count_block_stride = (unsigned int)(((number_of_clusters * sizeof(unsigned int) + line - 1) / line) * line / sizeof(unsigned int));
+
+	const size_t sum_block_size = (size_t)number_of_clusters * sum_row_stride;
+	cluster_sums.resize(sum_blocks * sum_block_size);
+	cluster_counts.resize((size_t)sum_blocks * count_block_stride);
+
+	// Each block is zeroed by the thread that goes on to fill it, where the
+	// pieces line up
+	parallel_for(sum_blocks, [&](unsigned int begin, unsigned int end, unsigned int)
+	{
+		std::fill(cluster_sums.begin() + begin * sum_block_size, cluster_sums.begin() + end * sum_block_size, (T)0);
+		std::fill(cluster_counts.begin() + (size_t)begin * count_block_stride, cluster_counts.begin() + (size_t)end * count_block_stride, 0u);
+	});
+
+	cluster_sums_valid = false;
+	incremental_sums_valid = false;
+}
+
+/*
+Build the per-cluster running sums and counts from the current assignments
+in one pass over the data. Each slice of the data points is summed in order
+into a block of its own by whichever thread takes it, so there is no sharing
+between threads until the blocks are added up, and the sums are the same for
+any number of threads.
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::accumulate_cluster_sums()
+{
+	reset_cluster_sums(sum_slice_count());
+
+	thread_pool().run(sum_blocks, [&](unsigned int block, unsigned int)
+	{
+		const unsigned int begin = block * sum_block_points;
+		const unsigned int end = std::min(number_of_points, begin + sum_block_points);
+		// Points still assigned to clusters beyond number_of_clusters, from
+		// before it was lowered, are left out
+		for (unsigned int i = begin; i < end; i++)
+		{
+			if ((*assignments)[i] < number_of_clusters)
+				add_to_cluster_sums(i, (*assignments)[i], block);
+		}
+	});
+
+	reduce_cluster_sums();
+	cluster_sums_valid = true;
+	incremental_sums_valid = incremental_centroids;
+	rounds_since_exact = 0;
+}
+
+/*
+Bring the kept cluster sums in block 0 up to date with the moved_points of
+the last assignment, taking each point out of the sum of the cluster it had
+and adding it to the one it has now, in point order. This runs on one thread,
+which is why assign_in_parallel stops listing the moves once there are too
+many, leaving compute_centroids to sum the whole data set again.
+Returns whether the sums are up to date.
+*/
+template <typename T, unsigned int N> bool tsClusters<T, N>::update_cluster_sums_from_moves()
+{
+	for (size_t m = 0; m < moved_points.size(); m++)
+	{
+		const unsigned int i = moved_points[m].first;
+		const T* p = point(i);
+		T* from = cluster_sum(moved_points[m].second);
+		T* to = cluster_sum((*assignments)[i]);
+		for (unsigned int j = 0; j < dimensions(); j++)
+		{
+			from[j] -= p[j];
+			to[j] += p[j];
+		}
+		cluster_count(moved_points[m].second)--;
+		cluster_count((*assignments)[i])++;
+	}
+
+	rounds_since_exact++;
+	return true;
+}
+
+/*
+Add up all the blocks of cluster sums and counts into block 0 as a tree, 
+first block 1 into 0, 3 into 2 and so on in parallel, then 2 into 0, 6 into 4
+and so on, in log2(sum_blocks) steps. The blocks are slices of the data in
+order, and are always paired the same way, so the sums come out the same
+from run to run and for any number of threads.
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::reduce_cluster_sums()
+{
+	for (unsigned int step = 1; step < sum_blocks; step *= 2)
+	{
+		const unsigned int pairs = (sum_blocks - step + 2 * step - 1) / (2 * step);
+
+		thread_pool().run(pairs, [&](unsigned int pair, unsigned int)
+		{
+			const unsigned int to = pair * 2 * step;
+			const unsigned int from = to + step;
+
+			for (unsigned int c = 0; c < number_of_clusters; c++)
+			{
+				T* sum = cluster_sum(c, to);
+				const T* other = cluster_sum(c, from);
+				for (unsigned int j = 0; j < dimensions(); j++)
+					sum[j] += other[j];
+				cluster_count(c, to) += cluster_count(c, from);
+			}
+		});
+	}
+}
+
+/*
+Train the clusters with mini-batch k-means (Sculley, "Web-Scale K-Means 
+Clustering", 2010) instead of full rounds of assign_clusters and 
+compute_centroids. Each iteration samples batch_size data points at random, 
+finds the nearest cluster to each, then moves each of those clusters toward its
+points with a per-cluster learning rate of one over the number of points it has
+taken in so far. Training stops once no cluster moves more than tolerance (an 
+actual, not squared, distance) in an iteration, or after max_iterations.
+This works on the data set from fill_data_array or fill_data_view, starting from
+the clusters made by initialize_clusters. If assign_all is set, a final 
+assign_clusters labels every data point.
+Returns the number of iterations run.
+*/
+template <typename T, unsigned int N> unsigned int tsClusters<T, N>::run_mini_batch(unsigned int batch_size, unsigned int max_iterations, T tolerance, bool assign_all)
+{
+	if (!stride || !number_of_clusters || !number_of_points || !batch_size)
+		return 0;
+
+	if (clusters->size() < (size_t)number_of_clusters * row_stride)
+		return 0;
+
+	cluster_update_counts.resize(number_of_clusters, 0);
+
+	std::uniform_int_distribution<unsigned int> pick(0, number_of_points - 1);
+	std::vector<unsigned int> batch(batch_size);
+	std::vector<unsigned int> batch_clusters(batch_size);
+	std::vector<T> previous(clusters->begin(), clusters->end());
+
+	unsigned int iteration = 0;
+	while (iteration < max_iterations)
+	{
+		iteration++;
+
+		// Sample the batch and find each point's nearest cluster before
+		// any of the clusters move
+		for (unsigned int b = 0; b < batch_size; b++)
+		{
+			T dsq;
+			batch[b] = pick(random_engine);
+			batch_clusters[b] = nearest_cluster(point(batch[b]), dsq);
+		}
+
+		for (unsigned int b = 0; b < batch_size; b++)
+			update_cluster_online(batch_clusters[b], point(batch[b]));
+
+		// Find the most any cluster moved in this iteration
+		T max_shift_squared = 0;
+		for (unsigned int c = 0; c < number_of_clusters; c++)
+		{
+			max_shift_squared = std::max(max_shift_squared, compute_squared_distance(cluster(c), &previous[(size_t)c * row_stride]));
+			memcpy(&previous[(size_t)c * row_stride], cluster(c), sizeof(T) * row_stride);
+		}
+
+		if (max_shift_squared <= tolerance * tolerance)
+			break;
+	}
+
+	// The clusters didn't move by compute_centroids, so any bounds are stale
+	bounds_valid = false;
+	centroids_current = false;
+	cluster_sums_valid = false;
+
+	if (use_transposed_clusters)
+		transpose_clusters();
+
+	if (assign_all)
+		assign_clusters();
+
+	return iteration;
+}
+
+/*
+Update the clusters from a chunk of streamed points, of size T values where
+stride is the dimension of each point, using sequential (online) k-means: 
+each point moves its nearest cluster toward it, as the running mean of the 
+points that cluster has taken in (to the nearest value, for an integer T).
+Nothing from the chunk is kept, so memory stays O(k*d) however many points
+are streamed, and get_clusters can be read between chunks at any time.
+If the clusters have not been set up by initialize_clusters (or an earlier
+chunk), they are created here, number_of_clusters of them (the stride, unless
+set_number_of_clusters was called), and placed on the first points streamed.
+Chunks must all have the same stride as the clusters, and as the data set if
+one is loaded, whose row stride the clusters keep.
+Returns the number of points taken from the chunk.
+*/
+template <typename T, unsigned int N> unsigned int tsClusters<T, N>::add_stream_points(const T* input_data, unsigned int input_size, unsigned int input_stride)
+{
+	if (!input_data || !input_stride || input_size < input_stride)
+		return 0;
+
+	if (N && input_stride != N)
+		return 0;
+
+	std::lock_guard<std::mutex> lock(tsLock);
+
+	// With a data set loaded, the clusters have to keep to its rows
+	if (number_of_points && input_stride != stride)
+		return 0;
+
+	if (!stride || !number_of_clusters || clusters->size() < (size_t)number_of_clusters * row_stride)
+	{
+		// Start the clusters from scratch, laid out like the data set if one
+		// is loaded, or else for the streamed points alone
+		if (!number_of_points)
+		{
+			stride = input_stride;
+			row_stride = ((stride + row_alignment - 1) / row_alignment) * row_alignment;
+		}
+		if (!number_of_clusters)
+			number_of_clusters = stride;
+
+		clusters->assign((size_t)number_of_clusters * row_stride, 0);
+		cluster_update_counts.assign(number_of_clusters, 0);
+		stream_clusters_unplaced = number_of_clusters;
+	}
+	else if (input_stride != stride)
+		return 0;
+
+	cluster_update_counts.resize(number_of_clusters, 0);
+
+	const unsigned int count = input_size / input_stride;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		const T* p = &input_data[(size_t)i * input_stride];
+
+		if (stream_clusters_unplaced)
+		{
+			update_cluster_online(number_of_clusters - stream_clusters_unplaced, p);
+			stream_clusters_unplaced--;
+			continue;
+		}
+
+		T dsq;
+		update_cluster_online(nearest_cluster(p, dsq), p);
+	}
+
+	// The clusters didn't move by compute_centroids, so any bounds are stale
+	bounds_valid = false;
+	centroids_current = false;
+	cluster_sums_valid = false;
+
+	if (use_transposed_clusters)
+		transpose_clusters();
+
+	return count;
+}
+
+/*
+Find the nearest cluster to a point by comparing it to every cluster, setting
+dsq to the squared distance to it. Ties go to the lowest index.
+*/
+template <typename T, unsigned int N> unsigned int tsClusters<T, N>::nearest_cluster(const T* p, T& dsq)
+{
+	unsigned int best = 0;
+	dsq = std::numeric_limits<T>::max();
+
+	for (unsigned int c = 0; c < number_of_clusters; c++)
+	{
+		const T d = compute_squared_distance(p, cluster(c));
+		if (d < dsq)
+		{
+			dsq = d;
+			best = c;
+		}
+	}
+
+	return best;
+}
+
+/*
+Move cluster c toward a point, as the running mean of every point folded
+into it by online updates so far. The step is worked out in bound_type, as
+the learning rate would always be 0 as an integer T, which then gets the 
+nearest value to it.
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::update_cluster_online(unsigned int c, const T* p)
+{
+	const bound_type rate = (bound_type)1 / (bound_type)(++cluster_update_counts[c]);
+	T* cp = cluster(c);
+
+	for (unsigned int j = 0; j < dimensions(); j++)
+	{
+		const bound_type moved = (bound_type)cp[j] + rate * ((bound_type)p[j] - (bound_type)cp[j]);
+		cp[j] = std::is_floating_point<T>::value ? (T)moved : (T)std::round(moved);
+	}
+}
+
+/*
+Enable or disable keeping a transposed, dimension-major copy of the clusters.
+When enabled, the assignment step computes the distance from a data point to
+all clusters in one linear sweep through the transposed matrix, which suits 
+many clusters of few dimensions. With AVX2 or AVX-512 the brute force
+assignment then finds the nearest cluster 8 or 16 clusters at a time (for
+float, or 4 or 8 for double), which is best for around 2 to 8 dimensions.
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::set_transposed_clusters(bool enable)
+{
+	use_transposed_clusters = enable;
+
+	if (use_transposed_clusters)
+		transpose_clusters();
+	else
+		clusters_transposed.clear();
+}
+
+/*
+Rebuild the stride x transposed_stride transposed copy of the clusters 
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::transpose_clusters()
+{
+	if (clusters->size() < (size_t)number_of_clusters * row_stride)
+		return;
+
+	const unsigned int padding = tsDistanceKernels<T>::nearest_padding;
+	const T padding_value = std::numeric_limits<T>::has_infinity ? std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max();
+	transposed_stride = ((number_of_clusters + padding - 1) / padding) * padding;
+	clusters_transposed.assign((size_t)stride * transposed_stride, padding_value);
+
+	for (unsigned int c = 0; c < number_of_clusters; c++)
+	{
+		const T* cp = cluster(c);
+		for (unsigned int j = 0; j < stride; j++)
+			clusters_transposed[(size_t)j * transposed_stride + c] = cp[j];
+	}
+}
+
+/*
+Turn the SIMD distance kernels on or off, where on picks the best of them
+for this processor. Off, every distance is computed by the scalar loop.
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::set_simd_distances(bool enable)
+{
+	distance_kernel = enable ? tsDistanceKernels<T>::select() : nullptr;
+	nearest_kernel = enable ? tsDistanceKernels<T>::select_nearest_transposed() : nullptr;
+	dot4_kernel = enable ? tsDistanceKernels<T>::select_dot4() : &tsDistanceKernels<T>::dot4_scalar;
+	bounded_kernel = enable ? tsDistanceKernels<T>::select_bounded() : &tsDistanceKernels<T>::bounded_scalar;
+}
+
+/*
+Enable or disable incremental centroids. Late in training few points change
+cluster each round, yet summing every point for compute_centroids takes a 
+whole pass over the data. With this on, the sums for the last assignments are
+kept, and each assign_clusters only takes the points that moved out of one
+sum and into another, which costs in proportion to the number moved. The
+sums are made in full whenever they aren't available, or too many points
+moved to be worth it, and every exact_every rounds if set, so that the
+rounding in the floating point sums can't drift far. The clusters can differ
+from those without it in the last bits, from the different rounding.
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::set_incremental_centroids(bool enable, unsigned int exact_every)
+{
+	incremental_centroids = enable;
+	exact_recompute_interval = exact_every;
+	if (!incremental_centroids)
+		incremental_sums_valid = false;
+}
+
+/*
+Enable or disable the partial distance search in brute force assignment.
+The distance from a data point to each cluster is given up on, between blocks
+of the SIMD kernel, once it has reached the distance to the nearest cluster so
+far, as it can no longer be the nearest. The assignments are the same.
+With order_by_variance, the dimensions are also summed in decreasing order of
+their variance over the data, so that the sums grow fastest early on. This
+keeps a reordered copy of the data, and the distances summed in a different
+order can differ in the last bits, so a point almost exactly as close to two
+clusters may go to either. Neither applies to the transposed clusters, to
+data of too few dimensions to be split into blocks, or to the other 
+assignment methods, whose bounds need every distance in full.
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::set_partial_distances(bool enable, bool order_by_variance)
+{
+	use_partial_distances = enable;
+	use_variance_order = enable && order_by_variance;
+
+	if (!use_variance_order)
+	{
+		dimension_order.clear();
+		placed_vector<T>().swap(ordered_points);
+		ordered_clusters.clear();
+	}
+}
+
+/*
+Work out the decreasing variance order of the dimensions for the data set, if
+not done yet, along with the reordered copy of the data points, and reorder
+the clusters to match. The variances are summed per piece of the data, 
+relative to the first point to keep the sums small.
+*/
+template <typename T, unsigned int N> void tsClusters<T, N>::update_dimension_order()
+{
+	const unsigned int d = dimensions();
+
+	if (dimension_order.empty())
+	{
+		const T* origin = point(0);
+		std::vector<double> piece_sums((size_t)thread_count() * 2 * d, 0);
+		const unsigned int used = parallel_for(number_of_points, [&](unsigned int begin, unsigned int end, unsigned int piece)
+		{
+			double* sum = &piece_sums[(size_t)piece * 2 * d];
+			double* sum_squares = sum + d;
+			for (unsigned int i = begin; i < end; i++)
+			{
+				const T* p = point(i);
+				for (unsigned int j = 0; j < d; j++)
+				{
+					const double v = (double)p[j] - (double)origin[j];
+					sum[j] += v;
+					sum_squares[j] += v * v;
+				}
+			}
+		});
+
+		// The variance times the number of points, which orders the same
+		std::vector<double> spread(d);
+		for (unsigned int j = 0; j < d; j++)
+		{
+			double sum = 0, sum_squares = 0;
+			for (unsigned int piece = 0; piece < used; piece++)
+			{
+				sum += piece_sums[(size_t)piece * 2 * d + j];
+				sum_squares += piece_sums[(size_t)piece * 2 * d + d + j];
+			}
+			spread[j] = sum_squares - sum * sum / number_of_points;
+		}
+
+		dimension_order.resize(d);
+		for (unsigned int j = 0; j < d; j++)
+			dimension_order[j] = j;
+		std::stable_sort(dimension_order.begin(), dimension_order.end(), [&](unsigned int a, unsigned int b)
+		{
+			return spread[a] > spread[b];
+		});
+
+		// Each thread fills in its own piece, padding and all
+		ordered_points.clear();
+		ordered_points.resize((size_t)number_of_points * row_stride);
+		parallel_for(number_of_points, [&](unsigned int begin, unsigned int end, unsigned int)
+		{
+			for (unsigned int i = begin; i < end; i++)
+			{
+				const T* p = point(i);
+				T* q = &ordered_points[(size_t)i * row_stride];
+				for (unsigned int j = 0; j < d; j++)
+					q[j] = p[dimension_order[j]];
+				for (unsigned int j = d; j < row_stride; j++)
+					q[j] = 0;
+			}
+		});
+	}
+
+	ordered_clusters.assign((size_t)number_of_clusters * row_stride, 0);
+	for (unsigned int c = 0; c < number_of_clusters; c++)
+	{
+		const T* cp = cluster(c);
+		for (unsigned int j = 0; j < d; j++)
+			ordered_clusters[(size_t)c * row_stride + j] = cp[dimension_order[j]];
+	}
+}
+
+/* Compute the squared distance, ignoring the expensive sqrt operation. 
+Useful for comparing without worrying about the _actual_ distance of the two points.
+If you want the _actual_ distance, just sqrt the return value of this. 
+Both points are expected to be at least stride T values long. 
+Longer rows go to the SIMD kernel picked for this processor, if any. */
+template <typename T, unsigned int N> T tsClusters<T, N>::compute_squared_distance(const T* pointA, const T* pointB)
+{
+	if (distance_kernel && dimensions() >= simd_min_dimensions)
+		return distance_kernel(pointA, pointB, dimensions());
+
+	T accum = 0;
+
+	for (unsigned int i = 0; i < dimensions(); i++)
+		accum += (pointA[i] - pointB[i]) * (pointA[i] - pointB[i]);
+
+	return accum;
+}
+
+/* As compute_squared_distance, but the SIMD kernel may stop once the sum 
+reaches limit, returning the sum so far, which is then at least limit. */
+template <typename T, unsigned int N> T tsClusters<T, N>::compute_partial_squared_distance(const T* pointA, const T* pointB, T limit)
+{
+	if (dimensions() >= simd_min_dimensions)
+		return bounded_kernel(pointA, pointB, dimensions(), limit);
+
+	return compute_squared_distance(pointA, pointB);
 }
 
 #endif // _TS_CLUSTERS_H
\ No newline at end of file
@@ -0,0 +1,1156 @@
+// tsDistanceKernels.h
+// Released under the MIT License
+// (http://opensource.org/licenses/mit-license.php)
+//
+// Definition of the tsDistanceKernels class
+// Squared Euclidean distance kernels using SSE2, AVX2 with FMA and
+// AVX-512, picked at runtime for the processor we're running on
+#ifndef _TS_DISTANCE_KERNELS_H
+#define _TS_DISTANCE_KERNELS_H
+
+#include <limits>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+#define TS_SIMD_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <immintrin.h>
+#endif
+
+// GCC and clang only generate AVX code in functions marked for it, so the
+// rest of the build doesn't need the flags (and can run on older processors)
+#if defined(__GNUC__) || defined(__clang__)
+#define TS_SIMD_TARGET(features) __attribute__((target(features)))
+#else
+#define TS_SIMD_TARGET(features)
+#endif
+
+// The AVX-512 intrinsics need Visual Studio 2017 or later
+#if defined(TS_SIMD_X86) && (defined(__GNUC__) || defined(__clang__) || (defined(_MSC_VER) && _MSC_VER >= 1910))
+#define TS_SIMD_AVX512
+#endif
+
+/*******************
+The idea here is to compute the squared distance between two rows of T values
+with explicit SIMD instructions, as wide as the processor allows, rather than
+hoping the compiler vectorizes the scalar loop (which it won't for floating
+point without being allowed to reorder the sum).
+
+The processor is checked once, through CPUID and for AVX through XGETBV (the
+operating system has to save the wider registers too), and the widest kernel
+it supports is handed out as a plain function pointer. The scalar kernel is
+the fallback on any other processor, and for any T other than float and double.
+
+Rows don't need to be aligned or a multiple of the vector width long. AVX2 and
+AVX-512 finish off the last partial vector with masked loads, and SSE2 with a
+short scalar loop.
+
+For low dimensional data, where a row is shorter than a vector, there are
+also kernels that find the nearest of a whole set of clusters to a point. 
+These take the clusters transposed, one row per dimension, so that a vector
+holds the same dimension of 8 or 16 clusters (AVX2 or AVX-512 with float),
+and keep the smallest distance seen in each lane and the cluster it was for
+as they go. Only the last few lanes are compared one at a time. They need
+the rows of the transposed clusters padded out to a multiple of 
+nearest_padding, with infinity in the padding so it never wins. There is no
+SSE2 or scalar version, as the caller's own loop over the clusters is as
+good there.
+
+For high dimensional data, there are kernels for the dot products of one row
+with four others at once, for the blocked matrix product form of the 
+distances, ||x||^2 - 2 x.c + ||c||^2. Each row of x is loaded once for the
+four products, which roughly halves the loads against one product at a time.
+
+For a nearest cluster search that only needs to know a distance is larger 
+than the best so far, there are bounded kernels that stop once the sum
+reaches a limit. They only check between whole blocks of partial_block
+values, to keep the sum across lanes off the inner loop, and otherwise add
+up the same way as the plain kernel, so a distance they finish is the same.
+As every term is positive, the sum at a check never exceeds the full sum.
+********************/
+template <typename T> class tsDistanceKernels
+{
+public:
+	typedef T (*squared_distance_function)(const T* a, const T* b, unsigned int n);
+
+	// Sum (a[i] - b[i])^2 for i in [0, n), one value at a time
+	static T scalar(const T* a, const T* b, unsigned int n)
+	{
+		T accum = 0;
+		for (unsigned int i = 0; i < n; i++)
+			accum += (a[i] - b[i]) * (a[i] - b[i]);
+		return accum;
+	}
+
+	// Return the best kernel for this processor
+	static squared_distance_function select() { return &scalar; }
+
+	// Return the name of the kernel select picks
+	static const char* selected_name() { return "scalar"; }
+
+	// Return the index of the nearest of k transposed clusters to p, laid out
+	// as n rows of k_stride T values, setting dsq to its squared distance. 
+	// Ties go to the lowest index.
+	typedef unsigned int (*nearest_transposed_function)(const T* p, const T* transposed, unsigned int k, unsigned int k_stride, unsigned int n, T& dsq);
+
+	// Return the best nearest cluster kernel for this processor, if any
+	static nearest_transposed_function select_nearest_transposed() { return nullptr; }
+
+	// The transposed rows need padding to a multiple of this many clusters
+	static const unsigned int nearest_padding = 16;
+
+	// Add the dot products of x with the four rows c, c + c_stride, 
+	// c + 2 * c_stride and c + 3 * c_stride, each n T values long, into dots
+	typedef void (*dot4_function)(const T* x, const T* c, size_t c_stride, unsigned int n, T* dots);
+
+	static void dot4_scalar(const T* x, const T* c, size_t c_stride, unsigned int n, T* dots)
+	{
+		T accum[4] = { 0, 0, 0, 0 };
+		for (unsigned int i = 0; i < n; i++)
+		{
+			accum[0] += x[i] * c[i];
+			accum[1] += x[i] * c[c_stride + i];
+			accum[2] += x[i] * c[2 * c_stride + i];
+			accum[3] += x[i] * c[3 * c_stride + i];
+		}
+		for (unsigned int r = 0; r < 4; r++)
+			dots[r] += accum[r];
+	}
+
+	// Return the best dot product kernel for this processor
+	static dot4_function select_dot4() { return &dot4_scalar; }
+
+	// As squared_distance_function, but stopping after any whole block of
+	// partial_block values once the sum reaches limit, returning the sum so
+	// far, which is then at least limit
+	typedef T (*bounded_distance_function)(const T* a, const T* b, unsigned int n, T limit);
+	static const unsigned int partial_block = 32;
+
+	static T bounded_scalar(const T* a, const T* b, unsigned int n, T limit)
+	{
+		T accum = 0;
+		unsigned int i = 0;
+		for (; i + partial_block <= n; i += partial_block)
+		{
+			for (unsigned int j = i; j < i + partial_block; j++)
+				accum += (a[j] - b[j]) * (a[j] - b[j]);
+			if (accum >= limit)
+				return accum;
+		}
+		for (; i < n; i++)
+			accum += (a[i] - b[i]) * (a[i] - b[i]);
+		return accum;
+	}
+
+	// Return the best bounded kernel for this processor
+	static bounded_distance_function select_bounded() { return &bounded_scalar; }
+};
+
+/*
+Pick the smallest of a set of SIMD lanes, which each hold a distance and the
+index of the cluster it is to, taking the lowest index among equals
+*/
+template <typename T, typename I> inline unsigned int tsSmallestLane(const T* values, const I* indexes, unsigned int lanes, T& dsq)
+{
+	unsigned int best = (unsigned int)indexes[0];
+	dsq = values[0];
+	for (unsigned int l = 1; l < lanes; l++)
+	{
+		if (values[l] < dsq || (values[l] == dsq && (unsigned int)indexes[l] < best))
+		{
+			dsq = values[l];
+			best = (unsigned int)indexes[l];
+		}
+	}
+	return best;
+}
+
+/*******************
+The processor features the kernels depend on, read once
+********************/
+class tsCpuFeatures
+{
+public:
+	bool sse2;
+	bool avx2_fma;
+	bool avx512f;
+
+	static const tsCpuFeatures& get()
+	{
+		static const tsCpuFeatures features;
+		return features;
+	}
+
+private:
+	tsCpuFeatures()
+	{
+		sse2 = avx2_fma = avx512f = false;
+
+#ifdef TS_SIMD_X86
+		unsigned int leaf1[4] = { 0 }, leaf7[4] = { 0 };
+		const unsigned int highest = cpuid(0, 0, leaf1);
+		cpuid(1, 0, leaf1);
+		if (highest >= 7)
+			cpuid(7, 0, leaf7);
+
+		sse2 = (leaf1[3] & (1u << 26)) != 0;
+
+		// AVX state has to be enabled by the operating system, as seen in XCR0
+		const bool osxsave = (leaf1[2] & (1u << 27)) != 0;
+		const unsigned long long xcr0 = osxsave ? xgetbv() : 0;
+		const bool avx_state = (xcr0 & 0x6) == 0x6; // SSE and AVX registers
+		const bool avx512_state = (xcr0 & 0xE6) == 0xE6; // Plus opmask and upper ZMM registers
+
+		const bool avx = (leaf1[2] & (1u << 28)) != 0;
+		const bool fma = (leaf1[2] & (1u << 12)) != 0;
+		const bool avx2 = (leaf7[1] & (1u << 5)) != 0;
+		avx2_fma = avx_state && avx && fma && avx2;
+
+#ifdef TS_SIMD_AVX512
+		avx512f = avx512_state && avx2_fma && (leaf7[1] & (1u << 16)) != 0;
+#endif
+#endif
+	}
+
+#ifdef TS_SIMD_X86
+	// Run CPUID for a leaf, filling in EAX, EBX, ECX and EDX, returning EAX
+	static unsigned int cpuid(unsigned int leaf, unsigned int subleaf, unsigned int* registers)
+	{
+#if defined(_MSC_VER)
+		int r[4];
+		__cpuidex(r, (int)leaf, (int)subleaf);
+		for (int i = 0; i < 4; i++)
+			registers[i] = (unsigned int)r[i];
+#else
+		__cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+		return registers[0];
+	}
+
+	static unsigned long long xgetbv()
+	{
+#if defined(_MSC_VER)
+		return _xgetbv(0);
+#else
+		unsigned int eax, edx;
+		__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+		return ((unsigned long long)edx << 32) | eax;
+#endif
+	}
+#endif
+};
+
+#ifdef TS_SIMD_X86
+
+/*******************
+Kernels for float, 4, 8 and 16 values at a time
+********************/
+template <> class tsDistanceKernels<float>
+{
+public:
+	typedef float (*squared_distance_function)(const float* a, const float* b, unsigned int n);
+
+	static float scalar(const float* a, const float* b, unsigned int n)
+	{
+		float accum = 0;
+		for (unsigned int i = 0; i < n; i++)
+			accum += (a[i] - b[i]) * (a[i] - b[i]);
+		return accum;
+	}
+
+	TS_SIMD_TARGET("sse2") static float sse2(const float* a, const float* b, unsigned int n)
+	{
+		__m128 accum = _mm_setzero_ps();
+		unsigned int i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			const __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+			accum = _mm_add_ps(accum, _mm_mul_ps(d, d));
+		}
+
+		float result = add_lanes(accum);
+		for (; i < n; i++)
+			result += (a[i] - b[i]) * (a[i] - b[i]);
+		return result;
+	}
+
+	// Add the four lanes together
+	TS_SIMD_TARGET("sse2") static float add_lanes(__m128 accum)
+	{
+		accum = _mm_add_ps(accum, _mm_movehl_ps(accum, accum));
+		accum = _mm_add_ss(accum, _mm_shuffle_ps(accum, accum, 1));
+		return _mm_cvtss_f32(accum);
+	}
+
+	TS_SIMD_TARGET("avx2,fma") static float avx2(const float* a, const float* b, unsigned int n)
+	{
+		// Two accumulators, so one FMA doesn't have to wait on the last
+		__m256 accum0 = _mm256_setzero_ps();
+		__m256 accum1 = _mm256_setzero_ps();
+		unsigned int i = 0;
+		for (; i + 16 <= n; i += 16)
+		{
+			const __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+			const __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+			accum0 = _mm256_fmadd_ps(d0, d0, accum0);
+			accum1 = _mm256_fmadd_ps(d1, d1, accum1);
+		}
+		for (; i + 8 <= n; i += 8)
+		{
+			const __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+			accum0 = _mm256_fmadd_ps(d, d, accum0);
+		}
+		if (i < n)
+		{
+			// Load only the lanes left, as zeros past the end of both rows
+			const __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)(n - i)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+			const __m256 d = _mm256_sub_ps(_mm256_maskload_ps(a + i, mask), _mm256_maskload_ps(b + i, mask));
+			accum1 = _mm256_fmadd_ps(d, d, accum1);
+		}
+
+		return add_lanes(_mm256_add_ps(accum0, accum1));
+	}
+
+	// Add the eight lanes together
+	TS_SIMD_TARGET("avx2,fma") static float add_lanes(__m256 accum)
+	{
+		__m128 sum = _mm_add_ps(_mm256_castps256_ps128(accum), _mm256_extractf128_ps(accum, 1));
+		sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+		sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+		return _mm_cvtss_f32(sum);
+	}
+
+#ifdef TS_SIMD_AVX512
+	TS_SIMD_TARGET("avx512f") static float avx512(const float* a, const float* b, unsigned int n)
+	{
+		__m512 accum0 = _mm512_setzero_ps();
+		__m512 accum1 = _mm512_setzero_ps();
+		unsigned int i = 0;
+		for (; i + 32 <= n; i += 32)
+		{
+			const __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+			const __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+			accum0 = _mm512_fmadd_ps(d0, d0, accum0);
+			accum1 = _mm512_fmadd_ps(d1, d1, accum1);
+		}
+		for (; i + 16 <= n; i += 16)
+		{
+			const __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+			accum0 = _mm512_fmadd_ps(d, d, accum0);
+		}
+		if (i < n)
+		{
+			const __mmask16 mask = (__mmask16)((1u << (n - i)) - 1);
+			const __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+			accum1 = _mm512_fmadd_ps(d, d, accum1);
+		}
+
+		return add_lanes(_mm512_add_ps(accum0, accum1));
+	}
+
+	// Add the sixteen lanes together, by way of two halves (which avoids
+	// the 512 bit extracts some versions of GCC warn about)
+	TS_SIMD_TARGET("avx512f") static float add_lanes(__m512 accum)
+	{
+		alignas(64) float lanes[16];
+		_mm512_store_ps(lanes, accum);
+		const __m256 half = _mm256_add_ps(_mm256_load_ps(lanes), _mm256_load_ps(lanes + 8));
+		__m128 sum = _mm_add_ps(_mm256_castps256_ps128(half), _mm256_extractf128_ps(half, 1));
+		sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+		sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+		return _mm_cvtss_f32(sum);
+	}
+#endif
+
+	static squared_distance_function select()
+	{
+		const tsCpuFeatures& cpu = tsCpuFeatures::get();
+#ifdef TS_SIMD_AVX512
+		if (cpu.avx512f)
+			return &avx512;
+#endif
+		if (cpu.avx2_fma)
+			return &avx2;
+		if (cpu.sse2)
+			return &sse2;
+		return &scalar;
+	}
+
+	static const char* selected_name()
+	{
+		const squared_distance_function f = select();
+		return f == &scalar ? "scalar" : f == &sse2 ? "sse2" : f == &avx2 ? "avx2" : "avx512";
+	}
+
+	typedef unsigned int (*nearest_transposed_function)(const float* p, const float* transposed, unsigned int k, unsigned int k_stride, unsigned int n, float& dsq);
+	static const unsigned int nearest_padding = 16;
+
+	TS_SIMD_TARGET("avx2,fma") static unsigned int nearest_transposed_avx2(const float* p, const float* transposed, unsigned int k, unsigned int k_stride, unsigned int n, float& dsq)
+	{
+		__m256 best = _mm256_set1_ps(std::numeric_limits<float>::max());
+		__m256i best_index = _mm256_setzero_si256();
+		__m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+		for (unsigned int c = 0; c < k; c += 8)
+		{
+			__m256 accum = _mm256_setzero_ps();
+			for (unsigned int j = 0; j < n; j++)
+			{
+				const __m256 d = _mm256_sub_ps(_mm256_set1_ps(p[j]), _mm256_loadu_ps(transposed + (size_t)j * k_stride + c));
+				accum = _mm256_add_ps(accum, _mm256_mul_ps(d, d));
+			}
+
+			// Only a strictly closer cluster replaces the one in its lane, so
+			// each lane keeps the lowest index among equals
+			const __m256 closer = _mm256_cmp_ps(accum, best, _CMP_LT_OQ);
+			best = _mm256_blendv_ps(best, accum, closer);
+			best_index = _mm256_blendv_epi8(best_index, index, _mm256_castps_si256(closer));
+			index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
+		}
+
+		alignas(32) float values[8];
+		alignas(32) int indexes[8];
+		_mm256_store_ps(values, best);
+		_mm256_store_si256((__m256i*)indexes, best_index);
+		return tsSmallestLane(values, indexes, 8, dsq);
+	}
+
+#ifdef TS_SIMD_AVX512
+	TS_SIMD_TARGET("avx512f") static unsigned int nearest_transposed_avx512(const float* p, const float* transposed, unsigned int k, unsigned int k_stride, unsigned int n, float& dsq)
+	{
+		__m512 best = _mm512_set1_ps(std::numeric_limits<float>::max());
+		__m512i best_index = _mm512_setzero_si512();
+		__m512i index = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+		for (unsigned int c = 0; c < k; c += 16)
+		{
+			__m512 accum = _mm512_setzero_ps();
+			for (unsigned int j = 0; j < n; j++)
+			{
+				const __m512 d = _mm512_sub_ps(_mm512_set1_ps(p[j]), _mm512_loadu_ps(transposed + (size_t)j * k_stride + c));
+				accum = _mm512_add_ps(accum, _mm512_mul_ps(d, d));
+			}
+
+			const __mmask16 closer = _mm512_cmp_ps_mask(accum, best, _CMP_LT_OQ);
+			best = _mm512_mask_blend_ps(closer, best, accum);
+			best_index = _mm512_mask_blend_epi32(closer, best_index, index);
+			index = _mm512_add_epi32(index, _mm512_set1_epi32(16));
+		}
+
+		alignas(64) float values[16];
+		alignas(64) int indexes[16];
+		_mm512_store_ps(values, best);
+		_mm512_store_si512(indexes, best_index);
+		return tsSmallestLane(values, indexes, 16, dsq);
+	}
+#endif
+
+	static nearest_transposed_function select_nearest_transposed()
+	{
+		const tsCpuFeatures& cpu = tsCpuFeatures::get();
+#ifdef TS_SIMD_AVX512
+		if (cpu.avx512f)
+			return &nearest_transposed_avx512;
+#endif
+		if (cpu.avx2_fma)
+			return &nearest_transposed_avx2;
+		return nullptr;
+	}
+
+	typedef void (*dot4_function)(const float* x, const float* c, size_t c_stride, unsigned int n, float* dots);
+
+	static void dot4_scalar(const float* x, const float* c, size_t c_stride, unsigned int n, float* dots)
+	{
+		float accum[4] = { 0, 0, 0, 0 };
+		for (unsigned int i = 0; i < n; i++)
+		{
+			accum[0] += x[i] * c[i];
+			accum[1] += x[i] * c[c_stride + i];
+			accum[2] += x[i] * c[2 * c_stride + i];
+			accum[3] += x[i] * c[3 * c_stride + i];
+		}
+		for (unsigned int r = 0; r < 4; r++)
+			dots[r] += accum[r];
+	}
+
+	TS_SIMD_TARGET("avx2,fma") static void dot4_avx2(const float* x, const float* c, size_t c_stride, unsigned int n, float* dots)
+	{
+		const float* c0 = c;
+		const float* c1 = c + c_stride;
+		const float* c2 = c + 2 * c_stride;
+		const float* c3 = c + 3 * c_stride;
+		__m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+
+		unsigned int i = 0;
+		for (; i + 8 <= n; i += 8)
+		{
+			const __m256 xv = _mm256_loadu_ps(x + i);
+			a0 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(c0 + i), a0);
+			a1 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(c1 + i), a1);
+			a2 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(c2 + i), a2);
+			a3 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(c3 + i), a3);
+		}
+		if (i < n)
+		{
+			const __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)(n - i)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+			const __m256 xv = _mm256_maskload_ps(x + i, mask);
+			a0 = _mm256_fmadd_ps(xv, _mm256_maskload_ps(c0 + i, mask), a0);
+			a1 = _mm256_fmadd_ps(xv, _mm256_maskload_ps(c1 + i, mask), a1);
+			a2 = _mm256_fmadd_ps(xv, _mm256_maskload_ps(c2 + i, mask), a2);
+			a3 = _mm256_fmadd_ps(xv, _mm256_maskload_ps(c3 + i, mask), a3);
+		}
+
+		// Pairwise adds leave the four sums in one vector, in order
+		const __m256 sums = _mm256_hadd_ps(_mm256_hadd_ps(a0, a1), _mm256_hadd_ps(a2, a3));
+		const __m128 sum = _mm_add_ps(_mm256_castps256_ps128(sums), _mm256_extractf128_ps(sums, 1));
+		_mm_storeu_ps(dots, _mm_add_ps(_mm_loadu_ps(dots), sum));
+	}
+
+#ifdef TS_SIMD_AVX512
+	TS_SIMD_TARGET("avx512f") static void dot4_avx512(const float* x, const float* c, size_t c_stride, unsigned int n, float* dots)
+	{
+		const float* c0 = c;
+		const float* c1 = c + c_stride;
+		const float* c2 = c + 2 * c_stride;
+		const float* c3 = c + 3 * c_stride;
+		__m512 a0 = _mm512_setzero_ps(), a1 = _mm512_setzero_ps(), a2 = _mm512_setzero_ps(), a3 = _mm512_setzero_ps();
+
+		unsigned int i = 0;
+		for (; i + 16 <= n; i += 16)
+		{
+			const __m512 xv = _mm512_loadu_ps(x + i);
+			a0 = _mm512_fmadd_ps(xv, _mm512_loadu_ps(c0 + i), a0);
+			a1 = _mm512_fmadd_ps(xv, _mm512_loadu_ps(c1 + i), a1);
+			a2 = _mm512_fmadd_ps(xv, _mm512_loadu_ps(c2 + i), a2);
+			a3 = _mm512_fmadd_ps(xv, _mm512_loadu_ps(c3 + i), a3);
+		}
+		if (i < n)
+		{
+			const __mmask16 mask = (__mmask16)((1u << (n - i)) - 1);
+			const __m512 xv = _mm512_maskz_loadu_ps(mask, x + i);
+			a0 = _mm512_fmadd_ps(xv, _mm512_maskz_loadu_ps(mask, c0 + i), a0);
+			a1 = _mm512_fmadd_ps(xv, _mm512_maskz_loadu_ps(mask, c1 + i), a1);
+			a2 = _mm512_fmadd_ps(xv, _mm512_maskz_loadu_ps(mask, c2 + i), a2);
+			a3 = _mm512_fmadd_ps(xv, _mm512_maskz_loadu_ps(mask, c3 + i), a3);
+		}
+
+		// Fold each down to 8 lanes, then add them up as for AVX2
+		alignas(64) float lanes[4][16];
+		_mm512_store_ps(lanes[0], a0);
+		_mm512_store_ps(lanes[1], a1);
+		_mm512_store_ps(lanes[2], a2);
+		_mm512_store_ps(lanes[3], a3);
+		__m256 h[4];
+		for (int r = 0; r < 4; r++)
+			h[r] = _mm256_add_ps(_mm256_load_ps(lanes[r]), _mm256_load_ps(lanes[r] + 8));
+
+		const __m256 sums = _mm256_hadd_ps(_mm256_hadd_ps(h[0], h[1]), _mm256_hadd_ps(h[2], h[3]));
+		const __m128 sum = _mm_add_ps(_mm256_castps256_ps128(sums), _mm256_extractf128_ps(sums, 1));
+		_mm_storeu_ps(dots, _mm_add_ps(_mm_loadu_ps(dots), sum));
+	}
+#endif
+
+	static dot4_function select_dot4()
+	{
+		const tsCpuFeatures& cpu = tsCpuFeatures::get();
+#ifdef TS_SIMD_AVX512
+		if (cpu.avx512f)
+			return &dot4_avx512;
+#endif
+		if (cpu.avx2_fma)
+			return &dot4_avx2;
+		return &dot4_scalar;
+	}
+
+	typedef float (*bounded_distance_function)(const float* a, const float* b, unsigned int n, float limit);
+	static const unsigned int partial_block = 32;
+
+	static float bounded_scalar(const float* a, const float* b, unsigned int n, float limit)
+	{
+		float accum = 0;
+		unsigned int i = 0;
+		for (; i + partial_block <= n; i += partial_block)
+		{
+			for (unsigned int j = i; j < i + partial_block; j++)
+				accum += (a[j] - b[j]) * (a[j] - b[j]);
+			if (accum >= limit)
+				return accum;
+		}
+		for (; i < n; i++)
+			accum += (a[i] - b[i]) * (a[i] - b[i]);
+		return accum;
+	}
+
+	// The same sums as sse2, with a check after each block of 32 values
+	TS_SIMD_TARGET("sse2") static float bounded_sse2(const float* a, const float* b, unsigned int n, float limit)
+	{
+		__m128 accum = _mm_setzero_ps();
+		unsigned int i = 0;
+		for (; i + partial_block <= n; i += partial_block)
+		{
+			for (unsigned int j = i; j < i + partial_block; j += 4)
+			{
+				const __m128 d = _mm_sub_ps(_mm_loadu_ps(a + j), _mm_loadu_ps(b + j));
+				accum = _mm_add_ps(accum, _mm_mul_ps(d, d));
+			}
+
+			const float partial = add_lanes(accum);
+			if (partial >= limit)
+				return partial;
+		}
+		for (; i + 4 <= n; i += 4)
+		{
+			const __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+			accum = _mm_add_ps(accum, _mm_mul_ps(d, d));
+		}
+
+		float result = add_lanes(accum);
+		for (; i < n; i++)
+			result += (a[i] - b[i]) * (a[i] - b[i]);
+		return result;
+	}
+
+	// The same sums as avx2, with a check after each block of 32 values
+	TS_SIMD_TARGET("avx2,fma") static float bounded_avx2(const float* a, const float* b, unsigned int n, float limit)
+	{
+		__m256 accum0 = _mm256_setzero_ps();
+		__m256 accum1 = _mm256_setzero_ps();
+		unsigned int i = 0;
+		for (; i + partial_block <= n; i += partial_block)
+		{
+			for (unsigned int j = i; j < i + partial_block; j += 16)
+			{
+				const __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + j), _mm256_loadu_ps(b + j));
+				const __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + j + 8), _mm256_loadu_ps(b + j + 8));
+				accum0 = _mm256_fmadd_ps(d0, d0, accum0);
+				accum1 = _mm256_fmadd_ps(d1, d1, accum1);
+			}
+
+			const float partial = add_lanes(_mm256_add_ps(accum0, accum1));
+			if (partial >= limit)
+				return partial;
+		}
+		for (; i + 16 <= n; i += 16)
+		{
+			const __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+			const __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+			accum0 = _mm256_fmadd_ps(d0, d0, accum0);
+			accum1 = _mm256_fmadd_ps(d1, d1, accum1);
+		}
+		for (; i + 8 <= n; i += 8)
+		{
+			const __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+			accum0 = _mm256_fmadd_ps(d, d, accum0);
+		}
+		if (i < n)
+		{
+			const __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)(n - i)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+			const __m256 d = _mm256_sub_ps(_mm256_maskload_ps(a + i, mask), _mm256_maskload_ps(b + i, mask));
+			accum1 = _mm256_fmadd_ps(d, d, accum1);
+		}
+		return add_lanes(_mm256_add_ps(accum0, accum1));
+	}
+
+#ifdef TS_SIMD_AVX512
+	// The same sums as avx512, with a check after each block of 32 values
+	TS_SIMD_TARGET("avx512f") static float bounded_avx512(const float* a, const float* b, unsigned int n, float limit)
+	{
+		__m512 accum0 = _mm512_setzero_ps();
+		__m512 accum1 = _mm512_setzero_ps();
+		unsigned int i = 0;
+		for (; i + partial_block <= n; i += partial_block)
+		{
+			const __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+			const __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+			accum0 = _mm512_fmadd_ps(d0, d0, accum0);
+			accum1 = _mm512_fmadd_ps(d1, d1, accum1);
+
+			const float partial = add_lanes(_mm512_add_ps(accum0, accum1));
+			if (partial >= limit)
+				return partial;
+		}
+		for (; i + 16 <= n; i += 16)
+		{
+			const __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+			accum0 = _mm512_fmadd_ps(d, d, accum0);
+		}
+		if (i < n)
+		{
+			const __mmask16 mask = (__mmask16)((1u << (n - i)) - 1);
+			const __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+			accum1 = _mm512_fmadd_ps(d, d, accum1);
+		}
+		return add_lanes(_mm512_add_ps(accum0, accum1));
+	}
+#endif
+
+	static bounded_distance_function select_bounded()
+	{
+		const tsCpuFeatures& cpu = tsCpuFeatures::get();
+#ifdef TS_SIMD_AVX512
+		if (cpu.avx512f)
+			return &bounded_avx512;
+#endif
+		if (cpu.avx2_fma)
+			return &bounded_avx2;
+		if (cpu.sse2)
+			return &bounded_sse2;
+		return &bounded_scalar;
+	}
+};
+
+/*******************
+Kernels for double, 2, 4 and 8 values at a time
+********************/
+template <> class tsDistanceKernels<double>
+{
+public:
+	typedef double (*squared_distance_function)(const double* a, const double* b, unsigned int n);
+
+	static double scalar(const double* a, const double* b, unsigned int n)
+	{
+		double accum = 0;
+		for (unsigned int i = 0; i < n; i++)
+			accum += (a[i] - b[i]) * (a[i] - b[i]);
+		return accum;
+	}
+
+	TS_SIMD_TARGET("sse2") static double sse2(const double* a, const double* b, unsigned int n)
+	{
+		__m128d accum = _mm_setzero_pd();
+		unsigned int i = 0;
+		for (; i + 2 <= n; i += 2)
+		{
+			const __m128d d = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+			accum = _mm_add_pd(accum, _mm_mul_pd(d, d));
+		}
+
+		double result = add_lanes(accum);
+		if (i < n)
+			result += (a[i] - b[i]) * (a[i] - b[i]);
+		return result;
+	}
+
+	// Add the two lanes together
+	TS_SIMD_TARGET("sse2") static double add_lanes(__m128d accum)
+	{
+		accum = _mm_add_sd(accum, _mm_unpackhi_pd(accum, accum));
+		return _mm_cvtsd_f64(accum);
+	}
+
+	TS_SIMD_TARGET("avx2,fma") static double avx2(const double* a, const double* b, unsigned int n)
+	{
+		__m256d accum0 = _mm256_setzero_pd();
+		__m256d accum1 = _mm256_setzero_pd();
+		unsigned int i = 0;
+		for (; i + 8 <= n; i += 8)
+		{
+			const __m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+			const __m256d d1 = _mm256_sub_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4));
+			accum0 = _mm256_fmadd_pd(d0, d0, accum0);
+			accum1 = _mm256_fmadd_pd(d1, d1, accum1);
+		}
+		for (; i + 4 <= n; i += 4)
+		{
+			const __m256d d = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+			accum0 = _mm256_fmadd_pd(d, d, accum0);
+		}
+		if (i < n)
+		{
+			const __m256i mask = _mm256_cmpgt_epi64(_mm256_set1_epi64x((long long)(n - i)), _mm256_setr_epi64x(0, 1, 2, 3));
+			const __m256d d = _mm256_sub_pd(_mm256_maskload_pd(a + i, mask), _mm256_maskload_pd(b + i, mask));
+			accum1 = _mm256_fmadd_pd(d, d, accum1);
+		}
+
+		return add_lanes(_mm256_add_pd(accum0, accum1));
+	}
+
+	TS_SIMD_TARGET("avx2,fma") static double add_lanes(__m256d accum)
+	{
+		__m128d sum = _mm_add_pd(_mm256_castpd256_pd128(accum), _mm256_extractf128_pd(accum, 1));
+		sum = _mm_add_sd(sum, _mm_unpackhi_pd(sum, sum));
+		return _mm_cvtsd_f64(sum);
+	}
+
+#ifdef TS_SIMD_AVX512
+	TS_SIMD_TARGET("avx512f") static double avx512(const double* a, const double* b, unsigned int n)
+	{
+		__m512d accum0 = _mm512_setzero_pd();
+		__m512d accum1 = _mm512_setzero_pd();
+		unsigned int i = 0;
+		for (; i + 16 <= n; i += 16)
+		{
+			const __m512d d0 = _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+			const __m512d d1 = _mm512_sub_pd(_mm512_loadu_pd(a + i + 8), _mm512_loadu_pd(b + i + 8));
+			accum0 = _mm512_fmadd_pd(d0, d0, accum0);
+			accum1 = _mm512_fmadd_pd(d1, d1, accum1);
+		}
+		for (; i + 8 <= n; i += 8)
+		{
+			const __m512d d = _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+			accum0 = _mm512_fmadd_pd(d, d, accum0);
+		}
+		if (i < n)
+		{
+			const __mmask8 mask = (__mmask8)((1u << (n - i)) - 1);
+			const __m512d d = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, a + i), _mm512_maskz_loadu_pd(mask, b + i));
+			accum1 = _mm512_fmadd_pd(d, d, accum1);
+		}
+
+		return add_lanes(_mm512_add_pd(accum0, accum1));
+	}
+
+	TS_SIMD_TARGET("avx512f") static double add_lanes(__m512d accum)
+	{
+		alignas(64) double lanes[8];
+		_mm512_store_pd(lanes, accum);
+		const __m256d half = _mm256_add_pd(_mm256_load_pd(lanes), _mm256_load_pd(lanes + 4));
+		__m128d sum = _mm_add_pd(_mm256_castpd256_pd128(half), _mm256_extractf128_pd(half, 1));
+		sum = _mm_add_sd(sum, _mm_unpackhi_pd(sum, sum));
+		return _mm_cvtsd_f64(sum);
+	}
+#endif
+
+	static squared_distance_function select()
+	{
+		const tsCpuFeatures& cpu = tsCpuFeatures::get();
+#ifdef TS_SIMD_AVX512
+		if (cpu.avx512f)
+			return &avx512;
+#endif
+		if (cpu.avx2_fma)
+			return &avx2;
+		if (cpu.sse2)
+			return &sse2;
+		return &scalar;
+	}
+
+	static const char* selected_name()
+	{
+		const squared_distance_function f = select();
+		return f == &scalar ? "scalar" : f == &sse2 ? "sse2" : f == &avx2 ? "avx2" : "avx512";
+	}
+
+	typedef unsigned int (*nearest_transposed_function)(const double* p, const double* transposed, unsigned int k, unsigned int k_stride, unsigned int n, double& dsq);
+	static const unsigned int nearest_padding = 16;
+
+	TS_SIMD_TARGET("avx2,fma") static unsigned int nearest_transposed_avx2(const double* p, const double* transposed, unsigned int k, unsigned int k_stride, unsigned int n, double& dsq)
+	{
+		__m256d best = _mm256_set1_pd(std::numeric_limits<double>::max());
+		__m256i best_index = _mm256_setzero_si256();
+		__m256i index = _mm256_setr_epi64x(0, 1, 2, 3);
+
+		for (unsigned int c = 0; c < k; c += 4)
+		{
+			__m256d accum = _mm256_setzero_pd();
+			for (unsigned int j = 0; j < n; j++)
+			{
+				const __m256d d = _mm256_sub_pd(_mm256_set1_pd(p[j]), _mm256_loadu_pd(transposed + (size_t)j * k_stride + c));
+				accum = _mm256_add_pd(accum, _mm256_mul_pd(d, d));
+			}
+
+			const __m256d closer = _mm256_cmp_pd(accum, best, _CMP_LT_OQ);
+			best = _mm256_blendv_pd(best, accum, closer);
+			best_index = _mm256_blendv_epi8(best_index, index, _mm256_castpd_si256(closer));
+			index = _mm256_add_epi64(index, _mm256_set1_epi64x(4));
+		}
+
+		alignas(32) double values[4];
+		alignas(32) long long indexes[4];
+		_mm256_store_pd(values, best);
+		_mm256_store_si256((__m256i*)indexes, best_index);
+		return tsSmallestLane(values, indexes, 4, dsq);
+	}
+
+#ifdef TS_SIMD_AVX512
+	TS_SIMD_TARGET("avx512f") static unsigned int nearest_transposed_avx512(const double* p, const double* transposed, unsigned int k, unsigned int k_stride, unsigned int n, double& dsq)
+	{
+		__m512d best = _mm512_set1_pd(std::numeric_limits<double>::max());
+		__m512i best_index = _mm512_setzero_si512();
+		__m512i index = _mm512_setr_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+
+		for (unsigned int c = 0; c < k; c += 8)
+		{
+			__m512d accum = _mm512_setzero_pd();
+			for (unsigned int j = 0; j < n; j++)
+			{
+				const __m512d d = _mm512_sub_pd(_mm512_set1_pd(p[j]), _mm512_loadu_pd(transposed + (size_t)j * k_stride + c));
+				accum = _mm512_add_pd(accum, _mm512_mul_pd(d, d));
+			}
+
+			const __mmask8 closer = _mm512_cmp_pd_mask(accum, best, _CMP_LT_OQ);
+			best = _mm512_mask_blend_pd(closer, best, accum);
+			best_index = _mm512_mask_blend_epi64(closer, best_index, index);
+			index = _mm512_add_epi64(index, _mm512_set1_epi64(8));
+		}
+
+		alignas(64) double values[8];
+		alignas(64) long long indexes[8];
+		_mm512_store_pd(values, best);
+		_mm512_store_si512(indexes, best_index);
+		return tsSmallestLane(values, indexes, 8, dsq);
+	}
+#endif
+
+	static nearest_transposed_function select_nearest_transposed()
+	{
+		const tsCpuFeatures& cpu = tsCpuFeatures::get();
+#ifdef TS_SIMD_AVX512
+		if (cpu.avx512f)
+			return &nearest_transposed_avx512;
+#endif
+		if (cpu.avx2_fma)
+			return &nearest_transposed_avx2;
+		return nullptr;
+	}
+
+	typedef void (*dot4_function)(const double* x, const double* c, size_t c_stride, unsigned int n, double* dots);
+
+	static void dot4_scalar(const double* x, const double* c, size_t c_stride, unsigned int n, double* dots)
+	{
+		double accum[4] = { 0, 0, 0, 0 };
+		for (unsigned int i = 0; i < n; i++)
+		{
+			accum[0] += x[i] * c[i];
+			accum[1] += x[i] * c[c_stride + i];
+			accum[2] += x[i] * c[2 * c_stride + i];
+			accum[3] += x[i] * c[3 * c_stride + i];
+		}
+		for (unsigned int r = 0; r < 4; r++)
+			dots[r] += accum[r];
+	}
+
+	TS_SIMD_TARGET("avx2,fma") static void dot4_avx2(const double* x, const double* c, size_t c_stride, unsigned int n, double* dots)
+	{
+		const double* c0 = c;
+		const double* c1 = c + c_stride;
+		const double* c2 = c + 2 * c_stride;
+		const double* c3 = c + 3 * c_stride;
+		__m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd(), a2 = _mm256_setzero_pd(), a3 = _mm256_setzero_pd();
+
+		unsigned int i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			const __m256d xv = _mm256_loadu_pd(x + i);
+			a0 = _mm256_fmadd_pd(xv, _mm256_loadu_pd(c0 + i), a0);
+			a1 = _mm256_fmadd_pd(xv, _mm256_loadu_pd(c1 + i), a1);
+			a2 = _mm256_fmadd_pd(xv, _mm256_loadu_pd(c2 + i), a2);
+			a3 = _mm256_fmadd_pd(xv, _mm256_loadu_pd(c3 + i), a3);
+		}
+		if (i < n)
+		{
+			const __m256i mask = _mm256_cmpgt_epi64(_mm256_set1_epi64x((long long)(n - i)), _mm256_setr_epi64x(0, 1, 2, 3));
+			const __m256d xv = _mm256_maskload_pd(x + i, mask);
+			a0 = _mm256_fmadd_pd(xv, _mm256_maskload_pd(c0 + i, mask), a0);
+			a1 = _mm256_fmadd_pd(xv, _mm256_maskload_pd(c1 + i, mask), a1);
+			a2 = _mm256_fmadd_pd(xv, _mm256_maskload_pd(c2 + i, mask), a2);
+			a3 = _mm256_fmadd_pd(xv, _mm256_maskload_pd(c3 + i, mask), a3);
+		}
+
+		// Pairwise adds, then the halves swapped into place, leave the four
+		// sums in one vector, in order
+		const __m256d t0 = _mm256_hadd_pd(a0, a1);
+		const __m256d t1 = _mm256_hadd_pd(a2, a3);
+		const __m256d sum = _mm256_add_pd(_mm256_permute2f128_pd(t0, t1, 0x20), _mm256_permute2f128_pd(t0, t1, 0x31));
+		_mm256_storeu_pd(dots, _mm256_add_pd(_mm256_loadu_pd(dots), sum));
+	}
+
+#ifdef TS_SIMD_AVX512
+	TS_SIMD_TARGET("avx512f") static void dot4_avx512(const double* x, const double* c, size_t c_stride, unsigned int n, double* dots)
+	{
+		const double* c0 = c;
+		const double* c1 = c + c_stride;
+		const double* c2 = c + 2 * c_stride;
+		const double* c3 = c + 3 * c_stride;
+		__m512d a0 = _mm512_setzero_pd(), a1 = _mm512_setzero_pd(), a2 = _mm512_setzero_pd(), a3 = _mm512_setzero_pd();
+
+		unsigned int i = 0;
+		for (; i + 8 <= n; i += 8)
+		{
+			const __m512d xv = _mm512_loadu_pd(x + i);
+			a0 = _mm512_fmadd_pd(xv, _mm512_loadu_pd(c0 + i), a0);
+			a1 = _mm512_fmadd_pd(xv, _mm512_loadu_pd(c1 + i), a1);
+			a2 = _mm512_fmadd_pd(xv, _mm512_loadu_pd(c2 + i), a2);
+			a3 = _mm512_fmadd_pd(xv, _mm512_loadu_pd(c3 + i), a3);
+		}
+		if (i < n)
+		{
+			const __mmask8 mask = (__mmask8)((1u << (n - i)) - 1);
+			const __m512d xv = _mm512_maskz_loadu_pd(mask, x + i);
+			a0 = _mm512_fmadd_pd(xv, _mm512_maskz_loadu_pd(mask, c0 + i), a0);
+			a1 = _mm512_fmadd_pd(xv, _mm512_maskz_loadu_pd(mask, c1 + i), a1);
+			a2 = _mm512_fmadd_pd(xv, _mm512_maskz_loadu_pd(mask, c2 + i), a2);
+			a3 = _mm512_fmadd_pd(xv, _mm512_maskz_loadu_pd(mask, c3 + i), a3);
+		}
+
+		alignas(64) double lanes[4][8];
+		_mm512_store_pd(lanes[0], a0);
+		_mm512_store_pd(lanes[1], a1);
+		_mm512_store_pd(lanes[2], a2);
+		_mm512_store_pd(lanes[3], a3);
+		__m256d h[4];
+		for (int r = 0; r < 4; r++)
+			h[r] = _mm256_add_pd(_mm256_load_pd(lanes[r]), _mm256_load_pd(lanes[r] + 4));
+
+		const __m256d t0 = _mm256_hadd_pd(h[0], h[1]);
+		const __m256d t1 = _mm256_hadd_pd(h[2], h[3]);
+		const __m256d sum = _mm256_add_pd(_mm256_permute2f128_pd(t0, t1, 0x20), _mm256_permute2f128_pd(t0, t1, 0x31));
+		_mm256_storeu_pd(dots, _mm256_add_pd(_mm256_loadu_pd(dots), sum));
+	}
+#endif
+
+	static dot4_function select_dot4()
+	{
+		const tsCpuFeatures& cpu = tsCpuFeatures::get();
+#ifdef TS_SIMD_AVX512
+		if (cpu.avx512f)
+			return &dot4_avx512;
+#endif
+		if (cpu.avx2_fma)
+			return &dot4_avx2;
+		return &dot4_scalar;
+	}
+
+	typedef double (*bounded_distance_function)(const double* a, const double* b, unsigned int n, double limit);
+	static const unsigned int partial_block = 16;
+
+	static double bounded_scalar(const double* a, const double* b, unsigned int n, double limit)
+	{
+		double accum = 0;
+		unsigned int i = 0;
+		for (; i + partial_block <= n; i += partial_block)
+		{
+			for (unsigned int j = i; j < i + partial_block; j++)
+				accum += (a[j] - b[j]) * (a[j] - b[j]);
+			if (accum >= limit)
+				return accum;
+		}
+		for (; i < n; i++)
+			accum += (a[i] - b[i]) * (a[i] - b[i]);
+		return accum;
+	}
+
+	// The same sums as sse2, with a check after each block of 16 values
+	TS_SIMD_TARGET("sse2") static double bounded_sse2(const double* a, const double* b, unsigned int n, double limit)
+	{
+		__m128d accum = _mm_setzero_pd();
+		unsigned int i = 0;
+		for (; i + partial_block <= n; i += partial_block)
+		{
+			for (unsigned int j = i; j < i + partial_block; j += 2)
+			{
+				const __m128d d = _mm_sub_pd(_mm_loadu_pd(a + j), _mm_loadu_pd(b + j));
+				accum = _mm_add_pd(accum, _mm_mul_pd(d, d));
+			}
+
+			const double partial = add_lanes(accum);
+			if (partial >= limit)
+				return partial;
+		}
+		for (; i + 2 <= n; i += 2)
+		{
+			const __m128d d = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+			accum = _mm_add_pd(accum, _mm_mul_pd(d, d));
+		}
+
+		double result = add_lanes(accum);
+		if (i < n)
+			result += (a[i] - b[i]) * (a[i] - b[i]);
+		return result;
+	}
+
+	// The same sums as avx2, with a check after each block of 16 values
+	TS_SIMD_TARGET("avx2,fma") static double bounded_avx2(const double* a, const double* b, unsigned int n, double limit)
+	{
+		__m256d accum0 = _mm256_setzero_pd();
+		__m256d accum1 = _mm256_setzero_pd();
+		unsigned int i = 0;
+		for (; i + partial_block <= n; i += partial_block)
+		{
+			for (unsigned int j = i; j < i + partial_block; j += 8)
+			{
+				const __m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a + j), _mm256_loadu_pd(b + j));
+				const __m256d d1 = _mm256_sub_pd(_mm256_loadu_pd(a + j + 4), _mm256_loadu_pd(b + j + 4));
+				accum0 = _mm256_fmadd_pd(d0, d0, accum0);
+				accum1 = _mm256_fmadd_pd(d1, d1, accum1);
+			}
+
+			const double partial = add_lanes(_mm256_add_pd(accum0, accum1));
+			if (partial >= limit)
+				return partial;
+		}
+		for (; i + 8 <= n; i += 8)
+		{
+			const __m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+			const __m256d d1 = _mm256_sub_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4));
+			accum0 = _mm256_fmadd_pd(d0, d0, accum0);
+			accum1 = _mm256_fmadd_pd(d1, d1, accum1);
+		}
+		for (; i + 4 <= n; i += 4)
+		{
+			const __m256d d = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+			accum0 = _mm256_fmadd_pd(d, d, accum0);
+		}
+		if (i < n)
+		{
+			const __m256i mask = _mm256_cmpgt_epi64(_mm256_set1_epi64x((long long)(n - i)), _mm256_setr_epi64x(0, 1, 2, 3));
+			const __m256d d = _mm256_sub_pd(_mm256_maskload_pd(a + i, mask), _mm256_maskload_pd(b + i, mask));
+			accum1 = _mm256_fmadd_pd(d, d, accum1);
+		}
+		return add_lanes(_mm256_add_pd(accum0, accum1));
+	}
+
+#ifdef TS_SIMD_AVX512
+	// The same sums as avx512, with a check after each block of 16 values
+	TS_SIMD_TARGET("avx512f") static double bounded_avx512(const double* a, const double* b, unsigned int n, double limit)
+	{
+		__m512d accum0 = _mm512_setzero_pd();
+		__m512d accum1 = _mm512_setzero_pd();
+		unsigned int i = 0;
+		for (; i + partial_block <= n; i += partial_block)
+		{
+			const __m512d d0 = _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+			const __m512d d1 = _mm512_sub_pd(_mm512_loadu_pd(a + i + 8), _mm512_loadu_pd(b + i + 8));
+			accum0 = _mm512_fmadd_pd(d0, d0, accum0);
+			accum1 = _mm512_fmadd_pd(d1, d1, accum1);
+
+			const double partial = add_lanes(_mm512_add_pd(accum0, accum1));
+			if (partial >= limit)
+				return partial;
+		}
+		for (; i + 8 <= n; i += 8)
+		{
+			const __m512d d = _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+			accum0 = _mm512_fmadd_pd(d, d, accum0);
+		}
+		if (i < n)
+		{
+			const __mmask8 mask = (__mmask8)((1u << (n - i)) - 1);
+			const __m512d d = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, a + i), _mm512_maskz_loadu_pd(mask, b + i));
+			accum1 = _mm512_fmadd_pd(d, d, accum1);
+		}
+		return add_lanes(_mm512_add_pd(accum0, accum1));
+	}
+#endif
+
+	static bounded_distance_function select_bounded()
+	{
+		const tsCpuFeatures& cpu = tsCpuFeatures::get();
+#ifdef TS_SIMD_AVX512
+		if (cpu.avx512f)
+			return &bounded_avx512;
+#endif
+		if (cpu.avx2_fma)
+			return &bounded_avx2;
+		if (cpu.sse2)
+			return &bounded_sse2;
+		return &bounded_scalar;
+	}
+};
+
+#endif // TS_SIMD_X86
+
+#endif // _TS_DISTANCE_KERNELS_H
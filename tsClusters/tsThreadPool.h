@@ -0,0 +1,665 @@
+// tsThreadPool.h
+// Released under the MIT License
+// (http://opensource.org/licenses/mit-license.php)
+//
+// Definition of the tsThreadPool class
+// A persistent pool of worker threads that runs a batch of
+// tasks at a time, balancing them across threads by work stealing
+#ifndef _TS_THREAD_POOL_H
+#define _TS_THREAD_POOL_H
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+#include <memory>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#if defined(_WIN32)
+// Only the kernel APIs are needed, so keep the rest of windows.h out of
+// everything that includes this, and don't leave its min, max, near and far
+// macros behind to break code that uses those names
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#define TS_THREAD_POOL_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#define TS_THREAD_POOL_NOMINMAX
+#endif
+#include <windows.h>
+#undef near
+#undef far
+#undef NEAR
+#undef FAR
+#define NEAR
+#define FAR
+#ifdef TS_THREAD_POOL_LEAN_AND_MEAN
+#undef WIN32_LEAN_AND_MEAN
+#undef TS_THREAD_POOL_LEAN_AND_MEAN
+#endif
+#ifdef TS_THREAD_POOL_NOMINMAX
+#undef NOMINMAX
+#undef TS_THREAD_POOL_NOMINMAX
+#endif
+#elif defined(__linux__)
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+/*******************
+The idea here is to start the worker threads once, and keep them waiting
+for work for the life of the pool, rather than starting new threads for
+every pass over the data. The pool can be owned by one tsClusters object or
+shared between several through a shared_ptr.
+
+Work is handed out as a batch of tasks numbered 0 to tasks - 1. Each worker
+starts with its own contiguous share of the task numbers, taking them from
+the front, and once it runs out it steals from the back of the other
+workers' shares. That way when some tasks finish much faster than others
+(as when the bounds skip most of the points in some ranges), the idle
+workers pick up the slack instead of waiting.
+
+The thread calling run takes part as worker 0, so a pool of size 1 starts
+no threads at all and runs everything on the caller.
+
+A NUMA aware pool spreads its workers evenly over the NUMA nodes the process
+may run on, in order (so worker 0 up to the first node's share are on node 0,
+and so on), and pins each of its own threads to the processors of its node.
+Workers then steal from the other workers on their own node before going to
+another node. On a machine with a single node, or where the topology can't
+be read, the pool is the same as one that isn't NUMA aware. The calling 
+thread is never pinned, as it belongs to the caller.
+
+By default the pool has one worker per processor the process can actually
+use, which in a container is often far fewer than the machine has. Running
+more threads than a CPU quota allows only gets them throttled.
+********************/
+class tsThreadPool
+{
+public:
+	tsThreadPool(unsigned int threads = 0, bool numa_aware = false); // 0 threads for cpu_budget()
+	virtual ~tsThreadPool();
+
+	// Return the number of workers, including the calling thread
+	unsigned int size() const { return number_of_workers; };
+
+	// Return the number of NUMA nodes the workers are spread over (1 unless NUMA aware)
+	unsigned int node_count() const { return number_of_nodes; };
+
+	// Return which of the NUMA nodes a worker is on, from 0 to node_count() - 1
+	unsigned int worker_node(unsigned int worker) const { return worker_nodes[worker]; };
+
+	// Run task(task_index, worker_index) for every task index in [0, tasks),
+	// returning when all of them are done. Not to be called from inside a task.
+	template <typename F> void run(unsigned int tasks, F task);
+
+	// Run task(worker_index) exactly once on every worker, with no stealing, 
+	// for work that has to happen on a particular worker (or node)
+	template <typename F> void run_on_each_worker(F task);
+
+	// Return the processors of each NUMA node that this process may run on,
+	// leaving out nodes with none (empty if the topology can't be read)
+	static std::vector<std::vector<unsigned int>> numa_node_processors();
+
+	// Parse a processor list like "0-3,8,10-11" as used by Linux sysfs
+	static std::vector<unsigned int> parse_processor_list(const std::string& list);
+
+	// Return how many threads this process can usefully run at once, as the
+	// logical processors it may run on, capped by any container CPU quota
+	static unsigned int cpu_budget();
+
+	// Return the CPU quota from the cgroup (v1 or v2) or job object the
+	// process runs in, rounded up to whole processors, or 0 if there isn't one
+	static unsigned int cpu_quota();
+
+private:
+	tsThreadPool(const tsThreadPool&); // Not copyable
+	tsThreadPool& operator=(const tsThreadPool&);
+
+	/* Each worker's share of the task numbers still to run, packed as the
+	front index in the high 32 bits and the back index in the low 32 bits
+	so both ends can be taken from with a single compare and swap. Padded
+	out to a cache line so workers don't contend on each other's shares. */
+	struct task_queue
+	{
+		std::atomic<unsigned long long> range;
+		char padding[64 - sizeof(std::atomic<unsigned long long>)];
+	};
+
+	unsigned int number_of_workers;
+	std::vector<std::thread> workers;
+	std::unique_ptr<task_queue[]> queues;
+
+	/* The NUMA node of each worker, and the processors of each node that
+	its workers are pinned to */
+	unsigned int number_of_nodes;
+	std::vector<unsigned int> worker_nodes;
+	std::vector<std::vector<unsigned int>> node_processors;
+
+	/* The batch being run, and a count that goes up with every batch so the
+	workers can tell a new one has arrived */
+	std::function<void(unsigned int, unsigned int)> batch;
+	unsigned long long generation;
+	unsigned int workers_busy;
+	bool stealing;
+	bool stopping;
+
+	std::mutex batch_lock; // Held by run, so one batch at a time
+	std::mutex state_lock; // Guards the batch, generation and counts
+	std::condition_variable batch_ready;
+	std::condition_variable batch_done;
+
+	template <typename F> void run_batch(unsigned int tasks, F task, bool steal);
+	void worker_loop(unsigned int worker);
+	void pin_to_node(unsigned int node);
+	void work_on_batch(unsigned int worker);
+	bool take_front(unsigned int queue, unsigned int& task);
+	bool take_back(unsigned int queue, unsigned int& task);
+};
+
+/*
+Start the worker threads, which wait for a batch to run
+*/
+inline tsThreadPool::tsThreadPool(unsigned int threads, bool numa_aware)
+{
+	if (!threads)
+		threads = cpu_budget();
+
+	number_of_workers = threads ? threads : 1;
+	queues.reset(new task_queue[number_of_workers]);
+	for (unsigned int w = 0; w < number_of_workers; w++)
+		queues[w].range = 0;
+
+	// Spread the workers evenly over the nodes, in order
+	if (numa_aware)
+		node_processors = numa_node_processors();
+
+	if (node_processors.size() <= 1 || number_of_workers == 1)
+		node_processors.clear();
+
+	number_of_nodes = node_processors.empty() ? 1 : (unsigned int)node_processors.size();
+	for (unsigned int w = 0; w < number_of_workers; w++)
+		worker_nodes.push_back((unsigned int)((unsigned long long)w * number_of_nodes / number_of_workers));
+
+	generation = 0;
+	workers_busy = 0;
+	stealing = true;
+	stopping = false;
+
+	for (unsigned int w = 1; w < number_of_workers; w++)
+		workers.push_back(std::thread(&tsThreadPool::worker_loop, this, w));
+}
+
+/*
+Tell the worker threads to stop, and wait for them
+*/
+inline tsThreadPool::~tsThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(state_lock);
+		stopping = true;
+	}
+	batch_ready.notify_all();
+
+	for (auto& w : workers)
+		w.join();
+}
+
+/*
+Run a batch of tasks across the workers, with the calling thread as worker 0
+*/
+template <typename F> void tsThreadPool::run(unsigned int tasks, F task)
+{
+	run_batch(tasks, task, true);
+}
+
+/*
+Run a task once on every worker, each of which is dealt just its own one
+*/
+template <typename F> void tsThreadPool::run_on_each_worker(F task)
+{
+	run_batch(number_of_workers, [&](unsigned int, unsigned int worker)
+	{
+		task(worker);
+	}, false);
+}
+
+/*
+Deal out a batch of tasks to the workers and run it, letting the workers steal
+from each other or not, and wait for it to finish
+*/
+template <typename F> void tsThreadPool::run_batch(unsigned int tasks, F task, bool steal)
+{
+	if (!tasks)
+		return;
+
+	std::lock_guard<std::mutex> lock(batch_lock);
+
+	// With one worker, or one task, there's nothing to share out
+	if (number_of_workers == 1 || tasks == 1)
+	{
+		for (unsigned int t = 0; t < tasks; t++)
+			task(t, 0);
+		return;
+	}
+
+	// Deal out a contiguous share of the tasks to each worker
+	for (unsigned int w = 0; w < number_of_workers; w++)
+	{
+		const unsigned long long front = (unsigned long long)tasks * w / number_of_workers;
+		const unsigned long long back = (unsigned long long)tasks * (w + 1) / number_of_workers;
+		queues[w].range = (front << 32) | back;
+	}
+
+	{
+		std::lock_guard<std::mutex> state(state_lock);
+		batch = task;
+		stealing = steal;
+		workers_busy = number_of_workers - 1;
+		generation++;
+	}
+	batch_ready.notify_all();
+
+	work_on_batch(0);
+
+	// Wait for the other workers to finish what they took
+	std::unique_lock<std::mutex> state(state_lock);
+	batch_done.wait(state, [this]{ return workers_busy == 0; });
+	batch = nullptr;
+}
+
+/*
+Wait for each batch and work on it, until the pool is destroyed
+*/
+inline void tsThreadPool::worker_loop(unsigned int worker)
+{
+	unsigned long long seen = 0;
+
+	if (!node_processors.empty())
+		pin_to_node(worker_nodes[worker]);
+
+	std::unique_lock<std::mutex> state(state_lock);
+	while (true)
+	{
+		batch_ready.wait(state, [&]{ return stopping || generation != seen; });
+		if (stopping)
+			return;
+
+		seen = generation;
+		state.unlock();
+
+		work_on_batch(worker);
+
+		state.lock();
+		if (--workers_busy == 0)
+			batch_done.notify_all();
+	}
+}
+
+/*
+Pin the calling thread to the processors of a NUMA node. This is only a
+hint, so if it fails the thread just carries on wherever it's scheduled.
+*/
+inline void tsThreadPool::pin_to_node(unsigned int node)
+{
+	const std::vector<unsigned int>& processors = node_processors[node];
+
+#if defined(_WIN32)
+	DWORD_PTR mask = 0;
+	for (unsigned int cpu : processors)
+	{
+		if (cpu < sizeof(DWORD_PTR) * 8)
+			mask |= (DWORD_PTR)1 << cpu;
+	}
+
+	if (mask)
+		SetThreadAffinityMask(GetCurrentThread(), mask);
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (unsigned int cpu : processors)
+	{
+		if (cpu < CPU_SETSIZE)
+			CPU_SET(cpu, &set);
+	}
+
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	(void)processors;
+#endif
+}
+
+/*
+Run this worker's own tasks from the front of its share, then steal tasks from
+the back of the other workers' shares until there are none left anywhere,
+trying the workers on the same node first
+*/
+inline void tsThreadPool::work_on_batch(unsigned int worker)
+{
+	unsigned int task = 0;
+
+	while (take_front(worker, task))
+		batch(task, worker);
+
+	if (!stealing)
+		return;
+
+	for (int same_node = 1; same_node >= 0; same_node--)
+	{
+		for (unsigned int i = 1; i < number_of_workers; i++)
+		{
+			const unsigned int victim = (worker + i) % number_of_workers;
+			if ((worker_nodes[victim] == worker_nodes[worker]) != (same_node == 1))
+				continue;
+
+			while (take_back(victim, task))
+				batch(task, worker);
+		}
+	}
+}
+
+/*
+Take the next task from the front of a share, returning false if it's empty
+*/
+inline bool tsThreadPool::take_front(unsigned int queue, unsigned int& task)
+{
+	unsigned long long range = queues[queue].range.load();
+	while (true)
+	{
+		const unsigned int front = (unsigned int)(range >> 32);
+		const unsigned int back = (unsigned int)(range & 0xFFFFFFFFull);
+		if (front >= back)
+			return false;
+
+		const unsigned long long taken = ((unsigned long long)(front + 1) << 32) | back;
+		if (queues[queue].range.compare_exchange_weak(range, taken))
+		{
+			task = front;
+			return true;
+		}
+	}
+}
+
+/*
+Take the last task from the back of a share, returning false if it's empty
+*/
+inline bool tsThreadPool::take_back(unsigned int queue, unsigned int& task)
+{
+	unsigned long long range = queues[queue].range.load();
+	while (true)
+	{
+		const unsigned int front = (unsigned int)(range >> 32);
+		const unsigned int back = (unsigned int)(range & 0xFFFFFFFFull);
+		if (front >= back)
+			return false;
+
+		const unsigned long long taken = ((unsigned long long)front << 32) | (back - 1);
+		if (queues[queue].range.compare_exchange_weak(range, taken))
+		{
+			task = back - 1;
+			return true;
+		}
+	}
+}
+
+/*
+Read the NUMA topology, as the processors of each node that this process is
+allowed to run on
+*/
+inline std::vector<std::vector<unsigned int>> tsThreadPool::numa_node_processors()
+{
+	std::vector<std::vector<unsigned int>> nodes;
+
+#if defined(_WIN32)
+	ULONG highest_node = 0;
+	DWORD_PTR process_mask = 0, system_mask = 0;
+	if (!GetNumaHighestNodeNumber(&highest_node) ||
+		!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+		return nodes;
+
+	for (ULONG node = 0; node <= highest_node && node < 256; node++)
+	{
+		ULONGLONG node_mask = 0;
+		if (!GetNumaNodeProcessorMask((UCHAR)node, &node_mask))
+			continue;
+
+		std::vector<unsigned int> processors;
+		for (unsigned int cpu = 0; cpu < sizeof(DWORD_PTR) * 8; cpu++)
+		{
+			if ((node_mask & process_mask) & ((ULONGLONG)1 << cpu))
+				processors.push_back(cpu);
+		}
+
+		if (!processors.empty())
+			nodes.push_back(processors);
+	}
+#elif defined(__linux__)
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed))
+		return nodes;
+
+	std::ifstream possible("/sys/devices/system/node/possible");
+	std::string list;
+	if (!std::getline(possible, list))
+		return nodes;
+
+	for (unsigned int node : parse_processor_list(list))
+	{
+		std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+		if (!std::getline(cpulist, list))
+			continue;
+
+		std::vector<unsigned int> processors;
+		for (unsigned int cpu : parse_processor_list(list))
+		{
+			if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+				processors.push_back(cpu);
+		}
+
+		if (!processors.empty())
+			nodes.push_back(processors);
+	}
+#endif
+
+	return nodes;
+}
+
+/*
+Parse a comma separated list of numbers and ranges of numbers, like "0-3,8",
+returning every number in it. Anything that doesn't parse is skipped.
+*/
+inline std::vector<unsigned int> tsThreadPool::parse_processor_list(const std::string& list)
+{
+	std::vector<unsigned int> numbers;
+	std::stringstream items(list);
+	std::string item;
+
+	while (std::getline(items, item, ','))
+	{
+		unsigned int first = 0, last = 0;
+		char dash = 0;
+		std::stringstream range(item);
+		if (!(range >> first))
+			continue;
+
+		if (!(range >> dash >> last) || dash != '-' || last < first)
+			last = first;
+
+		// Guard against a huge range from a garbled list
+		for (unsigned int n = first; n <= last && n - first < 65536; n++)
+			numbers.push_back(n);
+	}
+
+	return numbers;
+}
+
+/*
+Count the logical processors in the process affinity mask, which already
+leaves out any a Linux cpuset doesn't allow, and cap that by any CPU quota.
+Falls back to std::thread::hardware_concurrency where neither can be read.
+*/
+inline unsigned int tsThreadPool::cpu_budget()
+{
+	unsigned int processors = 0;
+
+#if defined(_WIN32)
+	DWORD_PTR process_mask = 0, system_mask = 0;
+	if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+	{
+		for (; process_mask; process_mask &= process_mask - 1)
+			processors++;
+	}
+#elif defined(__linux__)
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (!sched_getaffinity(0, sizeof(allowed), &allowed))
+		processors = (unsigned int)CPU_COUNT(&allowed);
+#endif
+
+	if (!processors)
+		processors = std::thread::hardware_concurrency();
+
+	const unsigned int quota = cpu_quota();
+	if (quota && (!processors || quota < processors))
+		processors = quota;
+
+	return processors ? processors : 1;
+}
+
+/*
+Find the CPU quota the process runs under. On Linux this is the CFS bandwidth
+limit of its cgroup (cpu.max for cgroup v2, cpu.cfs_quota_us over 
+cpu.cfs_period_us for v1), taking the tightest limit of the cgroup and any
+of its parents, and on Windows the hard cap on the CPU rate of its job object.
+*/
+inline unsigned int tsThreadPool::cpu_quota()
+{
+	double quota = 0; // In processors, 0 for no limit
+
+#if defined(_WIN32)
+#ifdef JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP
+	JOBOBJECT_CPU_RATE_CONTROL_INFORMATION rate;
+	if (QueryInformationJobObject(nullptr, JobObjectCpuRateControlInformation, &rate, sizeof(rate), nullptr) &&
+		(rate.ControlFlags & JOB_OBJECT_CPU_RATE_CONTROL_ENABLE) &&
+		(rate.ControlFlags & JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP))
+	{
+		// The rate is in hundredths of a percent of all the processors
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		quota = (double)rate.CpuRate * info.dwNumberOfProcessors / 10000.0;
+	}
+#endif
+#elif defined(__linux__)
+	// Find where the cgroup hierarchies are mounted, from lines like
+	// "35 24 0:30 / /sys/fs/cgroup rw,nosuid - cgroup2 cgroup2 rw"
+	std::string v2_mount, v2_root, v1_mount, v1_root;
+	std::ifstream mountinfo("/proc/self/mountinfo");
+	std::string line;
+	while (std::getline(mountinfo, line))
+	{
+		const size_t separator = line.find(" - ");
+		if (separator == std::string::npos)
+			continue;
+
+		std::stringstream before(line.substr(0, separator));
+		std::stringstream after(line.substr(separator + 3));
+		std::string id, parent, device, root, mount, type, source, options;
+		if (!(before >> id >> parent >> device >> root >> mount) || !(after >> type >> source >> options))
+			continue;
+
+		if (type == "cgroup2" && v2_mount.empty())
+		{
+			v2_mount = mount;
+			v2_root = root;
+		}
+		else if (type == "cgroup" && v1_mount.empty() && ("," + options + ",").find(",cpu,") != std::string::npos)
+		{
+			v1_mount = mount;
+			v1_root = root;
+		}
+	}
+
+	// Then which cgroup this process is in, from lines like "0::/kubepods/pod1"
+	// for v2 or "4:cpu,cpuacct:/kubepods/pod1" for v1
+	std::string v2_path, v1_path;
+	std::ifstream cgroup("/proc/self/cgroup");
+	while (std::getline(cgroup, line))
+	{
+		const size_t first = line.find(':');
+		const size_t second = (first == std::string::npos) ? first : line.find(':', first + 1);
+		if (second == std::string::npos)
+			continue;
+
+		const std::string controllers = "," + line.substr(first + 1, second - first - 1) + ",";
+		if (line.compare(0, first, "0") == 0 && controllers == ",,")
+			v2_path = line.substr(second + 1);
+		else if (controllers.find(",cpu,") != std::string::npos)
+			v1_path = line.substr(second + 1);
+	}
+
+	// Walk from the process's cgroup up to the root of the mount, reading
+	// the limit at each level, as a parent's limit applies to its children
+	auto tightest = [&](const std::string& mount, const std::string& root, std::string path, bool v2)
+	{
+		if (mount.empty())
+			return;
+
+		// Inside a container the mount's root is often the process's own
+		// cgroup, so the path is relative to that
+		if (root != "/" && path.compare(0, root.size(), root) == 0)
+			path = path.substr(root.size());
+
+		while (true)
+		{
+			const std::string directory = mount + path;
+			double limit = 0;
+
+			if (v2)
+			{
+				std::ifstream max_file(directory + "/cpu.max");
+				std::string max;
+				double period = 0;
+				if (max_file >> max >> period && max != "max" && period > 0)
+					limit = std::atof(max.c_str()) / period;
+			}
+			else
+			{
+				std::ifstream quota_file(directory + "/cpu.cfs_quota_us");
+				std::ifstream period_file(directory + "/cpu.cfs_period_us");
+				double quota_us = 0, period_us = 0;
+				if (quota_file >> quota_us && period_file >> period_us && quota_us > 0 && period_us > 0)
+					limit = quota_us / period_us;
+			}
+
+			if (limit > 0 && (quota == 0 || limit < quota))
+				quota = limit;
+
+			if (path.empty() || path == "/")
+				break;
+
+			const size_t slash = path.find_last_of('/');
+			path = (slash == std::string::npos) ? std::string() : path.substr(0, slash);
+		}
+	};
+
+	tightest(v2_mount, v2_root, v2_path, true);
+	tightest(v1_mount, v1_root, v1_path, false);
+#endif
+
+	if (quota <= 0)
+		return 0;
+
+	// A fraction of a processor still gets a thread
+	return std::max(1u, (unsigned int)std::ceil(quota - 1e-6));
+}
+
+#endif // _TS_THREAD_POOL_H